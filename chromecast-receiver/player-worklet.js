@@ -0,0 +1,287 @@
+/* player-worklet.js -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+'use strict';
+
+/*
+ * This file is loaded both as a regular script on the main thread, for SampleRing, and as an
+ * AudioWorklet module, where it registers the 'sound-player' processor.
+ */
+
+// Int32 control words at the start of ring buffer
+const RING_WRITE = 0;  // index of the next frame to write, only changed by writer
+const RING_READ = 1;  // index of the next frame to read, only changed by reader
+const RING_TARGET = 2;  // target number of buffered frames, set by writer
+const RING_UNDERRUNS = 3;  // number of underruns, incremented by reader
+const RING_END_FRAME = 4;  // AudioContext frame when the last written sample should be heard
+const RING_SYNC = 5;  // 1 when samples are played at RING_END_FRAME schedule instead of target
+const RING_DRIFT = 6;  // estimated clock drift in parts per billion, set by reader
+const RING_IDLE = 7;  // 1 when sender stopped sending because of silence, set by writer
+const RING_CONTROL_SIZE = 8;
+
+const MAX_STRETCH = 0.01;  // max playback speed change when adjusting to target
+const MAX_DRIFT = 0.001;  // max clock drift that is compensated
+const SYNC_MAX_ERROR = 0.02;  // seconds of schedule error corrected by stretching
+
+/*
+ * Gains of the rate controller. Buffer level is noisy because samples come in packets, so it's
+ * filtered with 1 s time constant and corrected slowly. Schedule error in sync mode is exact and
+ * has to be kept within few milliseconds.
+ */
+const TARGET_CONTROL = {filterTime: 1.0, kp: 0.05, ki: 0.0003};
+const SYNC_CONTROL = {filterTime: 0.1, kp: 0.5, ki: 0.02};
+
+/*
+ * Single producer single consumer ring of planar float samples. When backed by SharedArrayBuffer
+ * the main thread writes samples straight into memory that audio thread reads from, so nothing
+ * is allocated or copied on the way. One frame is always left empty to tell full from empty.
+ */
+class SampleRing {
+// public:
+    constructor(buffer, capacity, channels) {
+        this.buffer = buffer;
+        this.capacity = capacity;
+        this.control = new Int32Array(buffer, 0, RING_CONTROL_SIZE);
+        this.channels = [];
+        for (let c = 0; c < channels; ++c) {
+            this.channels.push(new Float32Array(
+                buffer, (RING_CONTROL_SIZE + c * capacity) * 4, capacity));
+        }
+    }
+
+    static create(capacity, channels, shared) {
+        const byteLength = (RING_CONTROL_SIZE + capacity * channels) * 4;
+        const buffer = shared ? new SharedArrayBuffer(byteLength) : new ArrayBuffer(byteLength);
+        return new SampleRing(buffer, capacity, channels);
+    }
+
+    available() {
+        const write = Atomics.load(this.control, RING_WRITE);
+        const read = Atomics.load(this.control, RING_READ);
+        return (write - read + this.capacity) % this.capacity;
+    }
+
+    space() {
+        return this.capacity - 1 - this.available();
+    }
+
+    getTarget() {
+        return Atomics.load(this.control, RING_TARGET);
+    }
+
+    setTarget(frames) {
+        Atomics.store(this.control, RING_TARGET, frames);
+    }
+
+    getUnderruns() {
+        return Atomics.load(this.control, RING_UNDERRUNS);
+    }
+
+    // Estimated ratio of sender and receiver clock frequencies minus one.
+    getDrift() {
+        return Atomics.load(this.control, RING_DRIFT) / 1e9;
+    }
+
+    // Schedules playout, so the last written sample is heard at endFrame of AudioContext.
+    setEndFrame(endFrame) {
+        Atomics.store(this.control, RING_END_FRAME, endFrame | 0);
+        Atomics.store(this.control, RING_SYNC, 1);
+    }
+
+    clearSync() {
+        Atomics.store(this.control, RING_SYNC, 0);
+    }
+
+    // Running out of samples while idle is expected, so it's not an underrun.
+    setIdle(idle) {
+        Atomics.store(this.control, RING_IDLE, idle ? 1 : 0);
+    }
+
+    /*
+     * Deinterleaves typed array (Int16Array, Int32Array or Float32Array) of stereo samples into
+     * the ring multiplying them by scale. Returns number of frames written, samples that don't
+     * fit are dropped.
+     */
+    writeInterleaved(samples, scale) {
+        const left = this.channels[0], right = this.channels[1];
+        const numFrames = Math.min(samples.length >> 1, this.space());
+        let write = Atomics.load(this.control, RING_WRITE);
+        let done = 0;
+        while (done < numFrames) {
+            const chunk = Math.min(numFrames - done, this.capacity - write);
+            for (let i = 0, j = done * 2; i < chunk; ++i, j += 2) {
+                left[write + i] = samples[j] * scale;
+                right[write + i] = samples[j + 1] * scale;
+            }
+            done += chunk;
+            write = (write + chunk) % this.capacity;
+        }
+        Atomics.store(this.control, RING_WRITE, write);
+        return numFrames;
+    }
+
+}
+
+if (typeof registerProcessor === 'function') {
+    /*
+     * Reads samples from SampleRing and keeps amount of buffered samples close to the target by
+     * slightly speeding up or slowing down playback with linear interpolation. When ring is not
+     * shared, interleaved samples and target come through the port and buffer state is reported
+     * back. Buffers of samples are sent back, so main thread can reuse them.
+     */
+    class SoundPlayerProcessor extends AudioWorkletProcessor {
+    // public:
+        constructor(options) {
+            super();
+            const opts = options.processorOptions;
+            if (opts.buffer) {
+                this.ring = new SampleRing(opts.buffer, opts.capacity, 2);
+            } else {
+                this.ring = SampleRing.create(opts.capacity, 2, false);
+                this.port.onmessage = event => this._onMessage(event.data);
+            }
+            this.shared = !!opts.buffer;
+            this.maxFrames = opts.maxFrames;
+            this.readFrac = 0;
+            this.playing = false;
+            this.quantums = 0;
+            this.error = 0;  // filtered error in seconds
+            this.drift = 0;
+        }
+
+        process(inputs, outputs) {
+            const output = outputs[0];
+            this._pull(output[0], output[1] || output[0]);
+            if (!this.shared && ++this.quantums % 32 === 0) {
+                this.port.postMessage({
+                    available: this.ring.available(),
+                    underruns: this.ring.getUnderruns(),
+                    drift: this.drift
+                });
+            }
+            return true;
+        }
+
+    // private:
+        _onMessage(message) {
+            if (message.samples) {
+                this.ring.setIdle(false);
+                this.ring.writeInterleaved(message.samples, message.scale);
+                const buffer = message.samples.buffer;
+                this.port.postMessage({buffer: buffer}, [buffer]);
+            }
+            if (message.idle) {
+                this.ring.setIdle(true);
+            }
+            if (message.target !== undefined) {
+                this.ring.setTarget(message.target);
+            }
+            if (message.endFrame === null) {
+                this.ring.clearSync();
+            } else if (message.endFrame !== undefined) {
+                this.ring.setEndFrame(message.endFrame);
+            }
+        }
+
+        _pull(left, right) {
+            const ring = this.ring;
+            const numFrames = left.length;
+            const capacity = ring.capacity;
+            const sync = Atomics.load(ring.control, RING_SYNC) === 1;
+            // In sync mode, target is the number of frames that are to be played before the last
+            // written one, so it's lower when samples are late and can be even negative.
+            const target = sync ?
+                (Atomics.load(ring.control, RING_END_FRAME) - (currentFrame | 0)) | 0 :
+                Math.max(1, ring.getTarget());
+            const write = Atomics.load(ring.control, RING_WRITE);
+            let read = Atomics.load(ring.control, RING_READ);
+            let available = (write - read + capacity) % capacity;
+
+            if (available > this.maxFrames || (sync ?
+                    available - target > SYNC_MAX_ERROR * sampleRate :
+                    available > 3 * target && available > sampleRate / 2)) {
+                // Way too much buffered or samples are late, skip straight to the target.
+                const skip = available - Math.max(0, Math.min(target, this.maxFrames));
+                read = (read + skip) % capacity;
+                available -= skip;
+                this.readFrac = 0;
+                this.error = 0;
+            } else if (sync && this.playing && target - available > SYNC_MAX_ERROR * sampleRate) {
+                // Samples are way too early, wait with silence until it's their time.
+                this.playing = false;
+                this.error = 0;
+            }
+            if (!this.playing && available >= target) {
+                this.playing = true;
+            }
+            if (!this.playing) {
+                left.fill(0);
+                right.fill(0);
+                return;
+            }
+
+            const ratio = this._getRatio((available - target) / sampleRate, numFrames,
+                                         sync ? SYNC_CONTROL : TARGET_CONTROL);
+            const inLeft = ring.channels[0], inRight = ring.channels[1];
+            let pos = this.readFrac;
+            let i = 0;
+            for (; i < numFrames && pos + 1 < available; ++i, pos += ratio) {
+                const base = Math.floor(pos);
+                const frac = pos - base;
+                const a = (read + base) % capacity;
+                const b = (a + 1) % capacity;
+                left[i] = inLeft[a] + (inLeft[b] - inLeft[a]) * frac;
+                right[i] = inRight[a] + (inRight[b] - inRight[a]) * frac;
+            }
+
+            if (i < numFrames) {
+                left.fill(0, i);
+                right.fill(0, i);
+                read = write;
+                this.readFrac = 0;
+                this.playing = false;
+                this.error = 0;
+                if (Atomics.load(ring.control, RING_IDLE) === 0) {
+                    Atomics.add(ring.control, RING_UNDERRUNS, 1);
+                }
+            } else {
+                const consumed = Math.floor(pos);
+                read = (read + consumed) % capacity;
+                this.readFrac = pos - consumed;
+            }
+            Atomics.store(ring.control, RING_READ, read);
+        }
+
+        /*
+         * PI controller of playback rate. Positive error means samples come faster than they are
+         * played, integral part converges to the clock drift between sender and receiver, so in
+         * the steady state samples are resampled by exactly the drift and buffer stays level.
+         */
+        _getRatio(error, numFrames, control) {
+            const dt = numFrames / sampleRate;
+            this.error += (error - this.error) * Math.min(1, dt / control.filterTime);
+            this.drift += control.ki * this.error * dt;
+            this.drift = Math.max(-MAX_DRIFT, Math.min(MAX_DRIFT, this.drift));
+            Atomics.store(this.ring.control, RING_DRIFT, Math.round(this.drift * 1e9));
+            const correction = this.drift + control.kp * this.error;
+            return 1.0 + Math.max(-MAX_STRETCH, Math.min(MAX_STRETCH, correction));
+        }
+    }
+
+    registerProcessor('sound-player', SoundPlayerProcessor);
+}
@@ -17,19 +17,72 @@
 
 'use strict';
 
-const SOUND_FRAGMENT_SIZE = 4096;  // samples
-const SAMPLE_RATE = 48000;  // samples / second
-const BUFFERING_TIME = 2.0;  // seconds
+const WORKLET_BLOCK_SIZE = 128;  // samples processed by AudioWorklet at once
+const MIN_BUFFERING_TIME = 0.02;  // seconds
+const MAX_BUFFERING_TIME = 2.0;  // seconds
+const BUFFERING_MARGIN = 0.01;  // seconds added to observed jitter, grows with underruns
+const JITTER_WINDOW = 500;  // packets over which jitter is observed
+const MAX_FREE_BUFFERS = 16;  // sample buffers kept for reuse after worklet sent them back
+
+/*
+ * Sample buffers transferred to the worklet come back to this pool, so receiving audio doesn't
+ * allocate new ones all the time.
+ */
+class BufferPool {
+// public:
+    constructor() {
+        this.buffers = [];
+    }
+
+    // Returns free buffer of at least byteLength bytes.
+    take(byteLength) {
+        for (let i = 0; i < this.buffers.length; ++i) {
+            if (this.buffers[i].byteLength >= byteLength) {
+                const buffer = this.buffers[i];
+                this.buffers[i] = this.buffers[this.buffers.length - 1];
+                this.buffers.pop();
+                return buffer;
+            }
+        }
+        return new ArrayBuffer(byteLength);
+    }
+
+    // The oldest buffer is dropped when pool is full, so sizes follow what's currently used.
+    give(buffer) {
+        if (this.buffers.length >= MAX_FREE_BUFFERS) {
+            this.buffers.shift();
+        }
+        this.buffers.push(buffer);
+    }
+}
+
+const bufferPool = new BufferPool();
 
 class SoundReceiver {
 // public:
-    constructor(name, address, soundCb, stateCb) {
+    /*
+     * rateCb is called with sample rate of the stream when sender couldn't provide sampleRate, it
+     * returns whether samples can be played at that rate.
+     */
+    constructor(name, address, sampleRate, soundCb, stateCb, rateCb) {
         try {
             this.name = name;
+            this.sampleRate = sampleRate;
             this.soundCallback = soundCb;
             this.stateCallback = stateCb;
+            this.rateCallback = rateCb;
 
             this.state = SoundReceiver.State.connecting;
+            this.codec = 'pcm';
+            this.sampleFormat = 's16';
+            this.decoder = null;
+            this.chunkTimestamp = 0;  // microseconds
+            this.chunkDuration = 0;
+            this.payloadOffset = 0;
+            this.frameHeader = false;
+            this.captureTime = null;  // of the last message, in sender microseconds
+            this.scratch = null;
+            this._resetStats();
 
             this.ws = new WebSocket(address);
             this.ws.binaryType = 'arraybuffer';
@@ -45,12 +98,34 @@ class SoundReceiver {
 
     close() {
         this.ws.close();
+        if (this.decoder !== null) {
+            this.decoder.close();
+            this.decoder = null;
+        }
     }
 
     getState() {
         return this.state;
     }
 
+    // Returns transport stats in microseconds, transit is reset on every call.
+    takeStats() {
+        const stats = {
+            transitMean: this.transitCount > 0 ?
+                Math.round(this.transitSum / this.transitCount) : 0,
+            transitMin: this.transitCount > 0 ? Math.round(this.transitMin) : 0,
+            transitMax: this.transitCount > 0 ? Math.round(this.transitMax) : 0,
+            jitter: Math.round(this.jitter),
+            lostFrames: this.lostFrames,
+            frames: this.transitCount
+        };
+        this.transitSum = 0;
+        this.transitCount = 0;
+        this.transitMin = Infinity;
+        this.transitMax = -Infinity;
+        return stats;
+    }
+
 // private:
     _onError(error) {
         if (this.state === SoundReceiver.State.connecting) {
@@ -62,9 +137,17 @@ class SoundReceiver {
     }
 
     _onOpen() {
+        // Opus is decoded with WebCodecs, so ask for it only when browser has them
+        const codecs = typeof AudioDecoder !== 'undefined' ? ['opus', 'pcm'] : ['pcm'];
         this.ws.send(JSON.stringify({
             type: 'SUBSCRIBE',
-            name: this.name
+            name: this.name,
+            codecs: codecs,
+            // Web Audio works on floats at the rate of AudioContext, so that's the best format
+            sampleRate: this.sampleRate,
+            sampleFormats: ['f32', 's24', 's16'],
+            channels: 2,
+            frameHeader: true
         }));
         this.state = SoundReceiver.State.connected;
         this.stateCallback(this.state);
@@ -76,23 +159,176 @@ class SoundReceiver {
     }
 
     _onMessage(message) {
+        if (typeof message.data === 'string') {
+            this._onTextMessage(JSON.parse(message.data));
+            return;
+        }
         if (!(message.data instanceof ArrayBuffer)) {
             console.warn('Expected ArrayBuffer as message, got ' +
                          message.data.constructor.name);
             return;
         }
-        const leftChan = new Float32Array(message.data.byteLength / 4);
-        const rightChan = new Float32Array(message.data.byteLength / 4);
-        const dataView = new DataView(message.data);
-        for (let i = 0, j = 0; i < message.data.byteLength; i += 4, j += 1) {
-            leftChan[j] = dataView.getInt16(i, true) / 32768.0;
-            rightChan[j] = dataView.getInt16(i + 2, true) / 32768.0;
+        const data = message.data;
+        const offset = this.frameHeader ? this._parseFrameHeader(data) : this.payloadOffset;
+        if (this.frameHeader && (new Uint8Array(data, 1, 1)[0] & SoundReceiver.FlagSilence)) {
+            // Null samples mark the start of digital silence, that's played locally.
+            this.soundCallback(null, 0, this.captureTime);
+            return;
+        }
+        if (this.codec === 'opus') {
+            this._decodeOpus(data, offset);
+        } else {
+            this._decodePcm(data, offset);
+        }
+    }
+
+    _resetStats() {
+        this.transitSum = 0;
+        this.transitCount = 0;
+        this.transitMin = Infinity;
+        this.transitMax = -Infinity;
+        this.lastTransit = null;
+        this.jitter = 0;
+        this.lostFrames = 0;
+        this.nextSequence = null;
+    }
+
+    // Updates transport stats from frame header and returns offset of the payload after it.
+    _parseFrameHeader(data) {
+        const arrival = performance.now() * 1000;
+        const view = new DataView(data);
+        const headerSize = view.getUint16(2, true);
+        const sequence = view.getUint32(4, true);
+        const captureTime = view.getUint32(8, true) + view.getInt32(12, true) * 4294967296;
+        this.captureTime = captureTime;
+
+        if (this.nextSequence !== null && sequence > this.nextSequence) {
+            this.lostFrames += sequence - this.nextSequence;
+        }
+        this.nextSequence = sequence + 1;
+
+        // Transit includes unknown clock offset, the sender removes it after clock sync.
+        const transit = arrival - captureTime;
+        this.transitSum += transit;
+        this.transitCount += 1;
+        this.transitMin = Math.min(this.transitMin, transit);
+        this.transitMax = Math.max(this.transitMax, transit);
+        if (this.lastTransit !== null) {
+            // Interarrival jitter estimator from RFC 3550
+            this.jitter += (Math.abs(transit - this.lastTransit) - this.jitter) / 16;
         }
+        this.lastTransit = transit;
 
-        this.soundCallback({left: leftChan, right: rightChan});
+        return headerSize;
+    }
+
+    _onTextMessage(message) {
+        if (message.type === 'SUBSCRIBED') {
+            this.codec = message.codec.name;
+            this.sampleFormat = message.sampleFormat;
+            this.frameHeader = message.frameHeader === true;
+            if (message.layout) {
+                this.payloadOffset = message.layout.payloadOffset;
+            }
+            this._resetStats();
+            if (message.sampleRate !== this.sampleRate) {
+                // Sender resamples to the requested rate, but Opus streams are always 48kHz and
+                // sender may not support the rate at all.
+                if (!this.rateCallback(message.sampleRate)) {
+                    console.error('incompatible sample rate ' + message.sampleRate +
+                                  ', closing stream');
+                    this.close();
+                    return;
+                }
+                this.sampleRate = message.sampleRate;
+            }
+            if (this.codec === 'opus') {
+                this.chunkDuration = message.codec.frameDuration * 1000;
+                this._createOpusDecoder(message.sampleRate, message.channels);
+            }
+            console.info('streaming with codec ' + this.codec + ', format ' +
+                         this.sampleFormat + ' ' + message.sampleRate + 'Hz');
+        } else {
+            console.warn('Unexpected message type ' + message.type);
+        }
+    }
+
+    _createOpusDecoder(sampleRate, channels) {
+        this.decoder = new AudioDecoder({
+            output: audioData => this._onDecoded(audioData),
+            error: e => console.error('Opus decoding failed: ' + e)
+        });
+        this.decoder.configure({
+            codec: 'opus',
+            sampleRate: sampleRate,
+            numberOfChannels: channels
+        });
+    }
+
+    _decodeOpus(data, offset) {
+        // Capture time is carried through decoder as timestamp of the chunk
+        this.decoder.decode(new EncodedAudioChunk({
+            type: 'key',
+            timestamp: this.frameHeader ? this.captureTime : this.chunkTimestamp,
+            data: new Uint8Array(data, offset)
+        }));
+        this.chunkTimestamp += this.chunkDuration;
+    }
+
+    _onDecoded(audioData) {
+        const samples = this._getScratch(Float32Array, audioData.numberOfFrames * 2);
+        audioData.copyTo(samples, {planeIndex: 0, format: 'f32'});
+        const captureTime = this.frameHeader ? audioData.timestamp : null;
+        audioData.close();
+        this.soundCallback(samples, 1.0, captureTime);
+    }
+
+    // Returns reusable typed array of given type and length.
+    _getScratch(type, length) {
+        // Scratch transferred to the worklet is detached and has zero length here.
+        if (this.scratch === null || this.scratch.byteLength < length * 4) {
+            this.scratch = bufferPool.take(length * 4);
+        }
+        return new type(this.scratch, 0, length);
+    }
+
+    /*
+     * Samples are handed over as typed array view of the message whenever they are aligned, so
+     * they are converted to floats only once, while being deinterleaved into the playback ring.
+     */
+    _decodePcm(data, offset) {
+        const sampleSize = SoundReceiver.SampleSize[this.sampleFormat];
+        const numSamples = Math.floor((data.byteLength - offset) / sampleSize) & ~1;
+        if (this.sampleFormat === 's24') {
+            const bytes = new Uint8Array(data, offset, numSamples * 3);
+            const samples = this._getScratch(Int32Array, numSamples);
+            for (let i = 0, j = 0; i < numSamples; ++i, j += 3) {
+                samples[i] = (bytes[j] | (bytes[j + 1] << 8) | (bytes[j + 2] << 16)) << 8 >> 8;
+            }
+            this.soundCallback(samples, 1 / 8388608.0, this.captureTime);
+            return;
+        }
+        if (offset % sampleSize !== 0) {
+            data = data.slice(offset);
+            offset = 0;
+        }
+        if (this.sampleFormat === 'f32') {
+            this.soundCallback(new Float32Array(data, offset, numSamples), 1.0, this.captureTime);
+        } else {
+            this.soundCallback(new Int16Array(data, offset, numSamples), 1 / 32768.0,
+                               this.captureTime);
+        }
     }
 }
 
+SoundReceiver.FlagSilence = 1;
+
+SoundReceiver.SampleSize = {
+    s16: 2,
+    s24: 3,
+    f32: 4
+}
+
 SoundReceiver.State = {
     connecting: 'connecting',
     connecting_failed: 'connecting_failed',
@@ -101,104 +337,235 @@ SoundReceiver.State = {
     error: 'error'
 }
 
-class SoundPlayer {
+/*
+ * JitterEstimator sizes target delay of the playback buffer from the observed arrival jitter: how
+ * much later than expected from the amount of already received audio the packets arrive. Target
+ * grows immediately when jitter goes up and shrinks when the worst case leaves the observation
+ * window.
+ */
+class JitterEstimator {
 // public:
-    constructor() {
-        this.context = new AudioContext();
-        if (this.context.sampleRate != SAMPLE_RATE) {
-            // TODO: add resampling here or on the backend
-            console.error('incompatibile sample rate!');
-        }
-
-        this.processor = this.context.createScriptProcessor(
-            SOUND_FRAGMENT_SIZE, 2, 2);
-        this.processor.onaudioprocess = event => this._processAudio(event);
+    constructor(sampleRate, blockSize) {
+        this.sampleRate = sampleRate;
+        // Output pulls whole blocks, so less than a block buffered is an underrun for sure.
+        this.minTarget = Math.max(MIN_BUFFERING_TIME, 1.5 * blockSize / sampleRate);
+        this.firstArrival = null;
+        this.framesPushed = 0;
+        this.delays = new Float64Array(JITTER_WINDOW);
+        this.delaysCount = 0;
+        this.target = this.minTarget;
+        this.rebase = false;
+    }
 
-        this.samplesBuffer = [];
-        this.partialSamples = null;
-        this.partialSamplesOffset = 0;
-        this.samplesInLast = 0;
-        this.playing = false;
+    // Nothing is received during pause, so the next packet isn't late, it just starts again.
+    pause() {
+        this.rebase = true;
+    }
 
-        this.processor.connect(this.context.destination);
+    // Returns target delay in seconds.
+    update(numFrames, underruns) {
+        const arrival = performance.now() / 1000;
+        if (this.firstArrival === null) {
+            this.firstArrival = arrival;
+        }
+        // How late is this packet compared to the audio clock, only differences matter.
+        let delay = arrival - this.firstArrival - this.framesPushed / this.sampleRate;
+        if (this.rebase && this.delaysCount > 0) {
+            // Continue as if it arrived in time
+            const count = Math.min(this.delaysCount, JITTER_WINDOW);
+            const min = Math.min.apply(null, this.delays.subarray(0, count));
+            this.firstArrival += delay - min;
+            delay = min;
+        }
+        this.rebase = false;
+        this.framesPushed += numFrames;
+        this.delays[this.delaysCount % JITTER_WINDOW] = delay;
+        this.delaysCount += 1;
+
+        let min = Infinity, max = -Infinity;
+        for (let i = 0; i < Math.min(this.delaysCount, JITTER_WINDOW); ++i) {
+            min = Math.min(min, this.delays[i]);
+            max = Math.max(max, this.delays[i]);
+        }
+        // Every underrun means we were too optimistic, so add some margin for each of them.
+        const margin = BUFFERING_MARGIN * (1 + Math.min(underruns, 10));
+        this.target = Math.min(MAX_BUFFERING_TIME,
+                               Math.max(this.minTarget, max - min + margin));
+        return this.target;
+    }
+}
 
-        this.nullSample = {
-            left: new Float32Array(SOUND_FRAGMENT_SIZE),
-            right: new Float32Array(SOUND_FRAGMENT_SIZE)
-        };
+/*
+ * SoundPlayer plays samples with the 'sound-player' AudioWorklet from player-worklet.js. When the
+ * page is cross-origin isolated, samples are written straight into SharedArrayBuffer ring read by
+ * the worklet. Otherwise their buffer is transferred to the worklet, which deinterleaves them into
+ * its ring and sends the buffer back to bufferPool.
+ */
+class SoundPlayer {
+// public:
+    constructor() {
+        this.sync = null;
+        this._start(new AudioContext());
     }
 
-    pushSamples(samples) {
-        let numSamples = samples.left.length;
-        let partial = this.partialSamples;
-        let offset = this.partialSamplesOffset;
+    /*
+     * Switches playback to sampleRate, so stream at other rate than AudioContext can be played.
+     * Returns false when browser can't play at that rate.
+     */
+    setSampleRate(sampleRate) {
+        if (sampleRate === this.context.sampleRate) {
+            return true;
+        }
+        let context;
+        try {
+            context = new AudioContext({sampleRate: sampleRate});
+        } catch (e) {
+            console.error('Failed to create AudioContext at ' + sampleRate + 'Hz: ' + e);
+            return false;
+        }
+        console.info('switching playback from ' + this.context.sampleRate + 'Hz to ' +
+                     sampleRate + 'Hz');
+        if (this.node !== null) {
+            this.node.disconnect();
+        }
+        this.context.close();
+        this._start(context);
+        return true;
+    }
 
-        for (let i = 0; i < numSamples; ++i) {
-            if (partial === null) {
-                partial = {
-                    left: new Float32Array(SOUND_FRAGMENT_SIZE),
-                    right: new Float32Array(SOUND_FRAGMENT_SIZE)
-                };
+    // Sets up playback through a new worklet in context.
+    _start(context) {
+        this.context = context;
+        const sampleRate = context.sampleRate;
+        this.estimator = new JitterEstimator(sampleRate, WORKLET_BLOCK_SIZE);
+        this.capacity = Math.ceil(MAX_BUFFERING_TIME * 2 * sampleRate);
+        this.shared = typeof SharedArrayBuffer !== 'undefined' && self.crossOriginIsolated === true;
+        this.ring = this.shared ? SampleRing.create(this.capacity, 2, true) : null;
+        this.node = null;
+        this.available = 0;  // reported by worklet when ring is not shared
+        this.underruns = 0;
+        this.drift = 0;
+        this.reportedUnderruns = 0;
+
+        context.audioWorklet.addModule('player-worklet.js').then(() => {
+            if (context !== this.context) {
+                return;  // replaced by context at another rate meanwhile
             }
-            partial.left[offset] = samples.left[i];
-            partial.right[offset] = samples.right[i];
-            offset += 1;
-            if (offset == SOUND_FRAGMENT_SIZE) {
-                this.samplesBuffer.push(partial);
-                partial = null;
-                offset = 0;
-            }
-        }
+            this.node = new AudioWorkletNode(context, 'sound-player', {
+                numberOfInputs: 0,
+                outputChannelCount: [2],
+                processorOptions: {
+                    buffer: this.shared ? this.ring.buffer : null,
+                    capacity: this.capacity,
+                    maxFrames: Math.round(MAX_BUFFERING_TIME * sampleRate)
+                }
+            });
+            this.node.port.onmessage = event => {
+                if (event.data.buffer) {
+                    bufferPool.give(event.data.buffer);
+                    return;
+                }
+                this.available = event.data.available;
+                this.underruns = event.data.underruns;
+                this.drift = event.data.drift;
+            };
+            this.node.connect(context.destination);
+        }).catch(e => console.error('Failed to load audio worklet: ' + e));
+    }
 
-        this.partialSamples = partial;
-        this.partialSamplesOffset = offset;
+    /*
+     * Makes player play samples captured by sender at captureTime at receiver time
+     * captureTime + clockOffset + playoutDelay (microseconds), so all receivers of sync group
+     * play them at the same time.
+     */
+    setSync(clockOffset, playoutDelay) {
+        this.sync = {clockOffset: clockOffset, playoutDelay: playoutDelay};
+    }
 
-        if (!this.playing && this._getTimeInBuffer() >= BUFFERING_TIME) {
-            this.playing = true;
+    clearSync() {
+        this.sync = null;
+        if (this.shared) {
+            this.ring.clearSync();
+        } else if (this.node !== null) {
+            this.node.port.postMessage({endFrame: null});
         }
     }
 
-// private:
-    _popSamples() {
-        if (!this.playing) {
-            return this.nullSample;
+    /*
+     * Pushes interleaved stereo samples (Int16Array, Int32Array or Float32Array) that are
+     * multiplied by scale to get floats. captureTime is null when sender doesn't provide it.
+     */
+    pushInterleaved(samples, scale, captureTime) {
+        if (samples === null) {
+            this._pushSilence();
+            return;
         }
-
-        // Quite brutal but should work fine
-        while (this._getTimeInBuffer() >= 1.5 * BUFFERING_TIME) {
-            this.samplesBuffer.shift();
+        const numFrames = samples.length >> 1;
+        const underruns = this.shared ? this.ring.getUnderruns() : this.underruns;
+        if (underruns !== this.reportedUnderruns) {
+            this.reportedUnderruns = underruns;
+            // printing sometimes takes long time
+            setTimeout(() => console.warn('Buffer underrun!'));
         }
-
-        if (this.samplesBuffer.length > 0) {
-            return this.samplesBuffer.shift();
+        const target = this.estimator.update(numFrames, underruns);
+        const targetFrames = Math.round(target * this.context.sampleRate);
+        const endFrame = this._getEndFrame(numFrames, captureTime);
+
+        if (this.shared) {
+            this.ring.setTarget(targetFrames);
+            if (endFrame !== null) {
+                this.ring.setEndFrame(endFrame);
+            }
+            this.ring.setIdle(false);
+            this.ring.writeInterleaved(samples, scale);
+        } else if (this.node !== null) {
+            // Samples are views of received message or decoder scratch, both unused after this.
+            const message = {samples: samples, scale: scale, target: targetFrames};
+            if (endFrame !== null) {
+                message.endFrame = endFrame;
+            }
+            this.node.port.postMessage(message, [samples.buffer]);
         }
+    }
 
-        // printing sometimes takes long time
-        setTimeout(() => console.warn("Buffer underrun!"));
+    getSampleRate() {
+        return this.context.sampleRate;
+    }
 
-        this.playing = false;
+    // Sender stopped sending because of digital silence, worklet plays zeros once buffer drains.
+    _pushSilence() {
+        this.estimator.pause();
+        if (this.shared) {
+            this.ring.setIdle(true);
+        } else if (this.node !== null) {
+            this.node.port.postMessage({idle: true});
+        }
+    }
 
-        if (this.partialSamples !== null) {
-            const partial = this.partialSamples;
-            this.partialSamples = null;
-            this.partialSamplesOffset = 0;
-            return partial;
-        } else {
-            return this.nullSample;
+    // Returns AudioContext frame when the last of samples should be heard in sync mode.
+    _getEndFrame(numFrames, captureTime) {
+        if (this.sync === null || captureTime === null) {
+            return null;
         }
+        const sampleRate = this.context.sampleRate;
+        const playAt = (captureTime + this.sync.clockOffset + this.sync.playoutDelay) / 1000 +
+                       numFrames / sampleRate * 1000;  // performance.now() milliseconds
+        // Output timestamp maps performance time to context time heard at that moment.
+        const timestamp = this.context.getOutputTimestamp();
+        return Math.round((timestamp.contextTime +
+                           (playAt - timestamp.performanceTime) / 1000) * sampleRate);
     }
 
-    _getTimeInBuffer() {
-        const numSamples = SOUND_FRAGMENT_SIZE * this.samplesBuffer.length +
-                           this.partialSamplesOffset;
-        return numSamples / SAMPLE_RATE;
+    // Clock drift between sender and receiver compensated by resampling, in ppm.
+    getDrift() {
+        return (this.shared ? this.ring.getDrift() : this.drift) * 1e6;
     }
 
-    _processAudio(event) {
-        const output = event.outputBuffer;
-        const samples = this._popSamples();
-        output.copyToChannel(samples.left, 0);
-        output.copyToChannel(samples.right, 1);
+    // Microseconds between pushing samples and them leaving the speakers.
+    getPlayoutDelay() {
+        const available = this.shared ? this.ring.available() : this.available;
+        const outputLatency = this.context.outputLatency || this.context.baseLatency || 0;
+        return Math.round((available / this.context.sampleRate + outputLatency) * 1000000);
     }
 };
 
@@ -244,6 +611,8 @@ function initChromecastReceiver() {
                 done('Already streaming', null);
                 return;
             }
+            // Stream of a sync group sets it again after clock sync
+            soundPlayer.clearSync();
             if (!(message.addresses instanceof Array)) {
                 done('"addresses" atribute is not an Array', null);
                 return;
@@ -260,10 +629,14 @@ function initChromecastReceiver() {
                 }
 
                 const addr = addrList.shift();
+                let receiver = null;
 
                 function handleStateUpdate(state) {
                     if (state == SoundReceiver.State.closed) {
-                        window.soundReceiver = null;
+                        // After STOP_STREAM next stream might already be started
+                        if (window.soundReceiver === receiver) {
+                            window.soundReceiver = null;
+                        }
                     } else if (state == SoundReceiver.State.connecting_failed) {
                         startStreamRecursive(addrList);
                     } else if (state == SoundReceiver.State.connected) {
@@ -271,10 +644,12 @@ function initChromecastReceiver() {
                     }
                 }
 
-                window.soundReceiver = new SoundReceiver(
-                    message.deviceName, addr,
-                    samples => window.soundPlayer.pushSamples(samples),
-                    handleStateUpdate);
+                receiver = window.soundReceiver = new SoundReceiver(
+                    message.deviceName, addr, window.soundPlayer.getSampleRate(),
+                    (samples, scale, captureTime) =>
+                        window.soundPlayer.pushInterleaved(samples, scale, captureTime),
+                    handleStateUpdate,
+                    sampleRate => window.soundPlayer.setSampleRate(sampleRate));
             }
 
             startStreamRecursive(message.addresses);
@@ -289,6 +664,15 @@ function initChromecastReceiver() {
             soundReceiver = null;
             done(null, null);
         },
+        'SET_SYNC': (message, done) => {
+            if (typeof message.clockOffset !== 'number' ||
+                    typeof message.playoutDelay !== 'number') {
+                done('"clockOffset" and "playoutDelay" have to be numbers', null);
+                return;
+            }
+            soundPlayer.setSync(message.clockOffset, message.playoutDelay);
+            done(null, null);
+        },
         'GET_STATE': (message, done) => {
             if (soundReceiver) {
                 done(null, {state: "STREAMING"});
@@ -301,6 +685,26 @@ function initChromecastReceiver() {
     websocketAppChannel.onMessage = event => {
         let message = event.data;
 
+        // PING is answered outside of request/response scheme to keep timestamps accurate.
+        if (message.type === 'PING') {
+            const t1 = Math.round(performance.now() * 1000);
+            let stats = null;
+            if (soundReceiver) {
+                stats = soundReceiver.takeStats();
+                stats.bufferDelay = soundPlayer.getPlayoutDelay();
+                stats.drift = soundPlayer.getDrift();
+            }
+            websocketAppChannel.send(event.senderId, {
+                'type': 'PONG',
+                'requestId': message.requestId,
+                't0': message.t0,
+                't1': t1,
+                't2': Math.round(performance.now() * 1000),
+                'stats': stats
+            });
+            return;
+        }
+
         function done(errorMessage, data) {
             if (errorMessage) {
                 websocketAppChannel.send(event.senderId, {
@@ -338,12 +742,15 @@ window.onload = function () {
         }
         console.info('connecting to ' + addr + ' as ' + device);
         window.soundReceiver = new SoundReceiver(
-            device, addr, samples => window.soundPlayer.pushSamples(samples),
+            device, addr, window.soundPlayer.getSampleRate(),
+            (samples, scale, captureTime) =>
+                window.soundPlayer.pushInterleaved(samples, scale, captureTime),
             state => {
                 if (state == SoundReceiver.State.closed) {
                     window.soundReceiver = null;
                 }
-            });
+            },
+            sampleRate => window.soundPlayer.setSampleRate(sampleRate));
     }
 
     initHTMLControls();
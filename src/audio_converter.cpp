@@ -0,0 +1,95 @@
+/* audio_converter.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "audio_converter.h"
+#include "audio_dsp.h"
+
+AudioConverter::AudioConverter(const AudioFormat& in_format_, const AudioFormat& out_format_,
+                               std::shared_ptr<AudioFramePool> pool_)
+        : in_format(in_format_), out_format(out_format_), pool(pool_) {
+    assert(in_format.channels == out_format.channels);
+    if (in_format.rate != out_format.rate) {
+        resampler = std::make_unique<PolyphaseResampler>(in_format.rate, out_format.rate,
+                                                         in_format.channels);
+    }
+}
+
+void AudioConverter::to_float(const AudioFrame& frame) {
+    std::size_t num = frame.size() / in_format.get_sample_size();
+    pcm.resize(num);
+    switch (in_format.sample_format) {
+        case SampleFormat::S16LE:
+            audio_dsp::s16_to_float(reinterpret_cast<const int16_t*>(frame.data()), pcm.data(),
+                                    num);
+            break;
+        case SampleFormat::S24LE:
+            audio_dsp::s24_to_float(reinterpret_cast<const uint8_t*>(frame.data()), pcm.data(),
+                                    num);
+            break;
+        case SampleFormat::F32LE: std::memcpy(pcm.data(), frame.data(), num * sizeof(float)); break;
+    }
+}
+
+void AudioConverter::from_float(const float* samples, std::size_t num, char* out) const {
+    switch (out_format.sample_format) {
+        case SampleFormat::S16LE:
+            audio_dsp::float_to_s16(samples, reinterpret_cast<int16_t*>(out), num);
+            break;
+        case SampleFormat::S24LE:
+            audio_dsp::float_to_s24(samples, reinterpret_cast<uint8_t*>(out), num);
+            break;
+        case SampleFormat::F32LE: std::memcpy(out, samples, num * sizeof(float)); break;
+    }
+}
+
+void AudioConverter::convert(AudioFrameRef input, const OutputFunc& output) {
+    assert(input->format() == in_format);
+    to_float(*input);
+    const int64_t capture_time = input->capture_time();
+    // Resampler filter still rings with the previous frame at the start of the first silent one.
+    const bool silent = input->silent() && (!resampler || previous_silent);
+    previous_silent = input->silent();
+    input.reset();
+
+    const float* samples = pcm.data();
+    std::size_t frames = pcm.size() / in_format.channels;
+    if (resampler) {
+        resampled.clear();
+        frames = resampler->process(pcm.data(), frames, resampled);
+        samples = resampled.data();
+    }
+
+    const std::size_t frame_size = out_format.get_frame_size();
+    const std::size_t max_frames = pool->get_frame_size() / frame_size;
+    for (std::size_t offset = 0; offset < frames; offset += max_frames) {
+        std::size_t chunk = std::min(max_frames, frames - offset);
+        auto frame = pool->acquire();
+        if (!frame) return;
+        from_float(samples + offset * out_format.channels, chunk * out_format.channels,
+                   frame->data());
+        frame->set_size(chunk * frame_size);
+        frame->set_format(out_format);
+        frame->set_capture_time(capture_time +
+                                static_cast<int64_t>(offset) * 1000000 / out_format.rate);
+        frame->set_silent(silent);
+        output(std::move(frame));
+    }
+}
@@ -0,0 +1,64 @@
+/* audio_converter.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "audio_format.h"
+#include "audio_frame_pool.h"
+#include "polyphase_resampler.h"
+
+/*
+ * AudioConverter is a pipeline stage converting frames between sample formats and rates. Samples
+ * are converted to float, resampled when rates differ and converted to the output format into
+ * frames from the pool. Output frames are aligned to whole samples of all channels.
+ *
+ * AudioConverter is not thread safe, it keeps resampler state between frames.
+ */
+class AudioConverter {
+  public:
+    typedef std::function<void(AudioFrameRef)> OutputFunc;
+
+    AudioConverter(const AudioConverter&) = delete;
+
+    // Throws ResamplerException when rates can't be converted.
+    AudioConverter(const AudioFormat& in_format_, const AudioFormat& out_format_,
+                   std::shared_ptr<AudioFramePool> pool_);
+
+    void convert(AudioFrameRef input, const OutputFunc& output);
+
+    const AudioFormat& get_in_format() const {
+        return in_format;
+    }
+
+    const AudioFormat& get_out_format() const {
+        return out_format;
+    }
+
+  private:
+    void to_float(const AudioFrame& frame);
+    void from_float(const float* samples, std::size_t num, char* out) const;
+
+    const AudioFormat in_format, out_format;
+    std::shared_ptr<AudioFramePool> pool;
+    std::unique_ptr<PolyphaseResampler> resampler;
+    std::vector<float> pcm, resampled;
+    bool previous_silent = false;
+};
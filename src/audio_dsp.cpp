@@ -0,0 +1,288 @@
+/* audio_dsp.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AUDIO_DSP_X86
+#include <immintrin.h>
+#endif
+
+#include "audio_dsp.h"
+
+namespace audio_dsp {
+
+namespace {
+
+constexpr float s16_scale = 32768.0f;
+constexpr float s24_scale = 8388608.0f;
+
+struct Kernels {
+    const char* name;
+    void (*s16_to_float)(const int16_t*, float*, std::size_t);
+    void (*float_to_s16)(const float*, int16_t*, std::size_t);
+    float (*dot_product)(const float*, const float*, std::size_t);
+    bool (*is_zero)(const uint8_t*, std::size_t);
+};
+
+/*
+ * Tail loops are always inlined, so they are compiled for the target of the SIMD function that
+ * handles the remaining samples with them. Calling non-VEX code from AVX code would stall on
+ * state transition.
+ */
+__attribute__((always_inline)) inline void s16_to_float_tail(const int16_t* in, float* out,
+                                                             std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+        out[i] = in[i] * (1.0f / s16_scale);
+    }
+}
+
+__attribute__((always_inline)) inline void float_to_s16_tail(const float* in, int16_t* out,
+                                                             std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+        float v = std::max(-s16_scale, std::min(s16_scale - 1.0f, in[i] * s16_scale));
+        out[i] = static_cast<int16_t>(std::lrint(v));
+    }
+}
+
+__attribute__((always_inline)) inline float dot_product_tail(const float* a, const float* b,
+                                                             std::size_t n) {
+    float sum = 0.0f;
+    for (std::size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((always_inline)) inline bool is_zero_tail(const uint8_t* data, std::size_t n) {
+    uint8_t acc = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        acc |= data[i];
+    }
+    return acc == 0;
+}
+
+void s16_to_float_scalar(const int16_t* in, float* out, std::size_t n) {
+    s16_to_float_tail(in, out, n);
+}
+
+void float_to_s16_scalar(const float* in, int16_t* out, std::size_t n) {
+    float_to_s16_tail(in, out, n);
+}
+
+float dot_product_scalar(const float* a, const float* b, std::size_t n) {
+    return dot_product_tail(a, b, n);
+}
+
+bool is_zero_scalar(const uint8_t* data, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        uint64_t w[4];
+        std::memcpy(w, data + i, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3]) != 0) return false;
+    }
+    return is_zero_tail(data + i, n - i);
+}
+
+#ifdef AUDIO_DSP_X86
+
+__attribute__((target("sse2"))) void s16_to_float_sse2(const int16_t* in, float* out,
+                                                       std::size_t n) {
+    const __m128 scale = _mm_set1_ps(1.0f / s16_scale);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        // Put 16 bit values into upper halves and shift them back to get sign extension.
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    s16_to_float_tail(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) void float_to_s16_sse2(const float* in, int16_t* out,
+                                                       std::size_t n) {
+    const __m128 scale = _mm_set1_ps(s16_scale);
+    const __m128 min = _mm_set1_ps(-s16_scale);
+    const __m128 max = _mm_set1_ps(s16_scale - 1.0f);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+        a = _mm_min_ps(_mm_max_ps(a, min), max);
+        b = _mm_min_ps(_mm_max_ps(b, min), max);
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packed);
+    }
+    float_to_s16_tail(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) float dot_product_sse2(const float* a, const float* b,
+                                                       std::size_t n) {
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    alignas(16) float parts[4];
+    _mm_store_ps(parts, _mm_add_ps(sum0, sum1));
+    return parts[0] + parts[1] + parts[2] + parts[3] + dot_product_tail(a + i, b + i, n - i);
+}
+
+// Chunks of 64 bytes are or-ed together, so non silent buffers exit early.
+__attribute__((target("sse2"))) bool is_zero_sse2(const uint8_t* data, std::size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    std::size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(data + i);
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                   _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) return false;
+    }
+    return is_zero_tail(data + i, n - i);
+}
+
+__attribute__((target("avx2"))) void s16_to_float_avx2(const int16_t* in, float* out,
+                                                       std::size_t n) {
+    const __m256 scale = _mm256_set1_ps(1.0f / s16_scale);
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v0 = _mm256_cvtepi16_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+        __m256i v1 = _mm256_cvtepi16_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8)));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v0), scale));
+        _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(v1), scale));
+    }
+    s16_to_float_tail(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) void float_to_s16_avx2(const float* in, int16_t* out,
+                                                       std::size_t n) {
+    const __m256 scale = _mm256_set1_ps(s16_scale);
+    const __m256 min = _mm256_set1_ps(-s16_scale);
+    const __m256 max = _mm256_set1_ps(s16_scale - 1.0f);
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale);
+        a = _mm256_min_ps(_mm256_max_ps(a, min), max);
+        b = _mm256_min_ps(_mm256_max_ps(b, min), max);
+        // packs works within 128 bit lanes, so lanes have to be put back in order.
+        __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), packed);
+    }
+    float_to_s16_tail(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) float dot_product_avx2(const float* a, const float* b,
+                                                           std::size_t n) {
+    __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    __m256 sum = _mm256_add_ps(sum0, sum1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    alignas(16) float parts[4];
+    _mm_store_ps(parts, half);
+    return parts[0] + parts[1] + parts[2] + parts[3] + dot_product_tail(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) bool is_zero_avx2(const uint8_t* data, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 128 <= n; i += 128) {
+        const __m256i* p = reinterpret_cast<const __m256i*>(data + i);
+        __m256i lo = _mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1));
+        __m256i hi = _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3));
+        __m256i acc = _mm256_or_si256(lo, hi);
+        if (!_mm256_testz_si256(acc, acc)) return false;
+    }
+    return is_zero_tail(data + i, n - i);
+}
+
+#endif  // AUDIO_DSP_X86
+
+Kernels select_kernels() {
+#ifdef AUDIO_DSP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return Kernels{"avx2", s16_to_float_avx2, float_to_s16_avx2, dot_product_avx2,
+                       is_zero_avx2};
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return Kernels{"sse2", s16_to_float_sse2, float_to_s16_sse2, dot_product_sse2,
+                       is_zero_sse2};
+    }
+#endif
+    return Kernels{"scalar", s16_to_float_scalar, float_to_s16_scalar, dot_product_scalar,
+                   is_zero_scalar};
+}
+
+const Kernels& kernels() {
+    static const Kernels selected = select_kernels();
+    return selected;
+}
+
+}  // namespace
+
+const char* get_implementation_name() {
+    return kernels().name;
+}
+
+void s16_to_float(const int16_t* in, float* out, std::size_t n) {
+    kernels().s16_to_float(in, out, n);
+}
+
+void float_to_s16(const float* in, int16_t* out, std::size_t n) {
+    kernels().float_to_s16(in, out, n);
+}
+
+void s24_to_float(const uint8_t* in, float* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i, in += 3) {
+        int32_t v = static_cast<int32_t>(static_cast<uint32_t>(in[0]) << 8 |
+                                         static_cast<uint32_t>(in[1]) << 16 |
+                                         static_cast<uint32_t>(in[2]) << 24);
+        out[i] = static_cast<float>(v >> 8) * (1.0f / s24_scale);
+    }
+}
+
+void float_to_s24(const float* in, uint8_t* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i, out += 3) {
+        float v = std::max(-s24_scale, std::min(s24_scale - 1.0f, in[i] * s24_scale));
+        uint32_t u = static_cast<uint32_t>(static_cast<int32_t>(std::lrint(v)));
+        out[0] = static_cast<uint8_t>(u);
+        out[1] = static_cast<uint8_t>(u >> 8);
+        out[2] = static_cast<uint8_t>(u >> 16);
+    }
+}
+
+float dot_product(const float* a, const float* b, std::size_t n) {
+    return kernels().dot_product(a, b, n);
+}
+
+bool is_zero(const void* data, std::size_t size) {
+    return kernels().is_zero(static_cast<const uint8_t*>(data), size);
+}
+
+}  // namespace audio_dsp
@@ -0,0 +1,44 @@
+/* audio_dsp.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Hot loops of the audio pipeline. 16 bit conversions, dot product and zero check have AVX2, SSE2
+ * and scalar implementations, the best one supported by the CPU is picked on first use. Pointers
+ * don't have to be aligned.
+ */
+namespace audio_dsp {
+
+const char* get_implementation_name();
+
+void s16_to_float(const int16_t* in, float* out, std::size_t n);
+void float_to_s16(const float* in, int16_t* out, std::size_t n);
+
+// Packed 24 bit samples, 3 bytes each.
+void s24_to_float(const uint8_t* in, float* out, std::size_t n);
+void float_to_s24(const float* in, uint8_t* out, std::size_t n);
+
+float dot_product(const float* a, const float* b, std::size_t n);
+
+// Whether all bytes are zero, i.e. samples in any format are digital silence.
+bool is_zero(const void* data, std::size_t size);
+
+}  // namespace audio_dsp
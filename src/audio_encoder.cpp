@@ -0,0 +1,146 @@
+/* audio_encoder.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_OPUS
+#include <opus.h>
+#endif
+
+#include "audio_encoder.h"
+#include "audio_sinks_manager.h"
+
+bool CodecConfig::is_supported(Codec codec) {
+    switch (codec) {
+        case Codec::PCM: return true;
+#ifdef HAVE_OPUS
+        case Codec::OPUS: return true;
+#endif
+        default: return false;
+    }
+}
+
+const char* CodecConfig::get_name(Codec codec) {
+    switch (codec) {
+        case Codec::PCM: return "pcm";
+        case Codec::OPUS: return "opus";
+    }
+    return "unknown";
+}
+
+class PcmAudioEncoder : public AudioEncoder {
+  public:
+    PcmAudioEncoder(const CodecConfig& config_) : AudioEncoder(config_) {}
+
+    void encode(AudioFrameRef input, const OutputFunc& output) override {
+        output(std::move(input));
+    }
+};
+
+#ifdef HAVE_OPUS
+
+class OpusAudioEncoder : public AudioEncoder {
+  public:
+    static constexpr int sample_rate = 48000;
+    static constexpr int channels = 2;
+
+    OpusAudioEncoder(const CodecConfig& config_, std::shared_ptr<AudioFramePool> pool_)
+            : AudioEncoder(config_), pool(pool_),
+              frame_samples(sample_rate / 1000 * config.frame_duration),
+              pcm(static_cast<std::size_t>(frame_samples)) {
+        int error;
+        encoder = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_RESTRICTED_LOWDELAY,
+                                      &error);
+        if (error != OPUS_OK) {
+            throw AudioEncoderException("Couldn't create opus encoder: " +
+                                        std::string(opus_strerror(error)));
+        }
+        opus_encoder_ctl(encoder, OPUS_SET_BITRATE(config.bitrate));
+    }
+
+    ~OpusAudioEncoder() {
+        opus_encoder_destroy(encoder);
+    }
+
+    void encode(AudioFrameRef input, const OutputFunc& output) override {
+        if (input->format() != AudioFormat()) {
+            // Opus is always negotiated with the default capture format, frames in any other
+            // format can only show up for a moment while the capture stream is restarted.
+            return;
+        }
+        const AudioSample* samples = reinterpret_cast<const AudioSample*>(input->data());
+        std::size_t num = input->size() / sizeof(AudioSample);
+        for (std::size_t i = 0; i < num;) {
+            if (pcm_fill == 0) {
+                packet_capture_time = input->capture_time() +
+                                      static_cast<int64_t>(i) * 1000000 / sample_rate;
+                packet_silent = true;
+            }
+            packet_silent = packet_silent && input->silent();
+            std::size_t n = std::min(num - i, pcm.size() - pcm_fill);
+            std::memcpy(&pcm[pcm_fill], samples + i, n * sizeof(AudioSample));
+            pcm_fill += n;
+            i += n;
+            if (pcm_fill == pcm.size()) {
+                pcm_fill = 0;
+                encode_packet(output);
+            }
+        }
+    }
+
+  private:
+    void encode_packet(const OutputFunc& output) {
+        auto packet = pool->acquire();
+        if (!packet) return;
+        opus_int32 len =
+                opus_encode(encoder, reinterpret_cast<const opus_int16*>(pcm.data()), frame_samples,
+                            reinterpret_cast<unsigned char*>(packet->data()),
+                            static_cast<opus_int32>(packet->capacity()));
+        if (len < 0) return;
+        packet->set_size(static_cast<std::size_t>(len));
+        packet->set_capture_time(packet_capture_time);
+        packet->set_silent(packet_silent);
+        output(std::move(packet));
+    }
+
+    std::shared_ptr<AudioFramePool> pool;
+    OpusEncoder* encoder;
+    int frame_samples;
+    std::vector<AudioSample> pcm;
+    std::size_t pcm_fill = 0;
+    int64_t packet_capture_time = 0;
+    bool packet_silent = false;
+};
+
+#endif
+
+std::unique_ptr<AudioEncoder> AudioEncoder::create(const CodecConfig& config,
+                                                   std::shared_ptr<AudioFramePool> pool) {
+    (void)pool;  // not used when compiled without any compressed codec
+    switch (config.codec) {
+        case CodecConfig::Codec::PCM: return std::make_unique<PcmAudioEncoder>(config);
+#ifdef HAVE_OPUS
+        case CodecConfig::Codec::OPUS: return std::make_unique<OpusAudioEncoder>(config, pool);
+#endif
+        default:
+            throw AudioEncoderException(std::string("Codec not supported: ") +
+                                        CodecConfig::get_name(config.codec));
+    }
+}
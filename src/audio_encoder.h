@@ -0,0 +1,73 @@
+/* audio_encoder.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "audio_frame_pool.h"
+
+class AudioEncoderException : public std::runtime_error {
+  public:
+    AudioEncoderException(std::string message) : std::runtime_error(message) {}
+};
+
+struct CodecConfig {
+    enum class Codec { PCM, OPUS };
+
+    Codec codec = Codec::PCM;
+    int bitrate = 0;         // bits per second, only for compressed codecs
+    int frame_duration = 0;  // milliseconds, only for compressed codecs
+
+    bool operator==(const CodecConfig& other) const {
+        return codec == other.codec && bitrate == other.bitrate &&
+               frame_duration == other.frame_duration;
+    }
+
+    static bool is_supported(Codec codec);
+    static const char* get_name(Codec codec);
+};
+
+/*
+ * AudioEncoder is a pipeline stage between captured frames and the websocket. Encoders may
+ * buffer input internally, so single input frame can result in zero or more output frames.
+ */
+class AudioEncoder {
+  public:
+    typedef std::function<void(AudioFrameRef)> OutputFunc;
+
+    AudioEncoder(const AudioEncoder&) = delete;
+    virtual ~AudioEncoder() = default;
+
+    // Throws AudioEncoderException when encoder couldn't be created.
+    static std::unique_ptr<AudioEncoder> create(const CodecConfig& config,
+                                                std::shared_ptr<AudioFramePool> pool);
+
+    virtual void encode(AudioFrameRef input, const OutputFunc& output) = 0;
+
+    const CodecConfig& get_config() const {
+        return config;
+    }
+
+  protected:
+    AudioEncoder(const CodecConfig& config_) : config(config_) {}
+
+    CodecConfig config;
+};
@@ -0,0 +1,84 @@
+/* audio_format.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum class SampleFormat { S16LE, S24LE, F32LE };
+
+/*
+ * Format of interleaved audio samples as they are captured and sent to receivers.
+ */
+struct AudioFormat {
+    SampleFormat sample_format = SampleFormat::S16LE;
+    uint32_t rate = 48000;
+    uint8_t channels = 2;
+
+    std::size_t get_sample_size() const {
+        switch (sample_format) {
+            case SampleFormat::S16LE: return 2;
+            case SampleFormat::S24LE: return 3;
+            case SampleFormat::F32LE: return 4;
+        }
+        return 0;
+    }
+
+    // Size of samples for all channels at single point in time.
+    std::size_t get_frame_size() const {
+        return get_sample_size() * channels;
+    }
+
+    // Duration of audio in microseconds.
+    int64_t get_duration_us(std::size_t bytes) const {
+        return static_cast<int64_t>(bytes / get_frame_size()) * 1000000 / rate;
+    }
+
+    bool operator==(const AudioFormat& other) const {
+        return sample_format == other.sample_format && rate == other.rate &&
+               channels == other.channels;
+    }
+
+    bool operator!=(const AudioFormat& other) const {
+        return !(*this == other);
+    }
+
+    static const char* get_name(SampleFormat format) {
+        switch (format) {
+            case SampleFormat::S16LE: return "s16";
+            case SampleFormat::S24LE: return "s24";
+            case SampleFormat::F32LE: return "f32";
+        }
+        return "unknown";
+    }
+
+    // Returns false when name is not a known sample format.
+    static bool parse_sample_format(const std::string& name, SampleFormat* format) {
+        if (name == "s16") {
+            *format = SampleFormat::S16LE;
+        } else if (name == "s24") {
+            *format = SampleFormat::S24LE;
+        } else if (name == "f32") {
+            *format = SampleFormat::F32LE;
+        } else {
+            return false;
+        }
+        return true;
+    }
+};
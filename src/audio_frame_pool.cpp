@@ -0,0 +1,87 @@
+/* audio_frame_pool.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cassert>
+
+#include "audio_frame_pool.h"
+
+void AudioFrame::set_size(std::size_t size_) {
+    assert(size_ <= buffer_capacity);
+    length = size_;
+}
+
+void AudioFrameRef::reset() {
+    if (frame && frame->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // Keep pool alive until we are done with returning frame to it.
+        auto pool = std::move(frame->pool);
+        pool->release(frame);
+    }
+    frame = nullptr;
+}
+
+AudioFramePool::AudioFramePool(std::size_t num_frames, std::size_t frame_size_, private_tag)
+        : frame_size(frame_size_), memory(new char[num_frames * frame_size_]) {
+    frames.reserve(num_frames);
+    free_frames.reserve(num_frames);
+    for (std::size_t i = 0; i < num_frames; ++i) {
+        frames.emplace_back(new AudioFrame(memory.get() + i * frame_size, frame_size));
+        free_frames.push_back(frames.back().get());
+    }
+}
+
+std::shared_ptr<AudioFramePool> AudioFramePool::create(std::size_t num_frames,
+                                                       std::size_t frame_size) {
+    return std::make_shared<AudioFramePool>(num_frames, frame_size, private_tag{});
+}
+
+AudioFrameRef AudioFramePool::acquire() {
+    AudioFrame* frame;
+    {
+        std::lock_guard<std::mutex> guard(mu);
+        if (free_frames.empty()) {
+            ++exhausted;
+            return AudioFrameRef();
+        }
+        frame = free_frames.back();
+        free_frames.pop_back();
+        ++acquired;
+        peak_in_use = std::max(peak_in_use, frames.size() - free_frames.size());
+    }
+    frame->length = 0;
+    frame->capture_time_us = 0;
+    frame->is_silent = false;
+    frame->pool = shared_from_this();
+    return AudioFrameRef(frame);
+}
+
+void AudioFramePool::release(AudioFrame* frame) {
+    std::lock_guard<std::mutex> guard(mu);
+    free_frames.push_back(frame);
+}
+
+AudioFramePool::Stats AudioFramePool::get_stats() const {
+    std::lock_guard<std::mutex> guard(mu);
+    Stats stats;
+    stats.frames = frames.size();
+    stats.frame_size = frame_size;
+    stats.in_use = frames.size() - free_frames.size();
+    stats.peak_in_use = peak_in_use;
+    stats.acquired = acquired;
+    stats.exhausted = exhausted;
+    return stats;
+}
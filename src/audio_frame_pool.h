@@ -0,0 +1,200 @@
+/* audio_frame_pool.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "audio_format.h"
+
+class AudioFramePool;
+
+/*
+ * AudioFrame is a fixed capacity buffer for audio data owned by AudioFramePool. Frames are never
+ * allocated or freed after the pool is created, they are only handed out and returned.
+ */
+class AudioFrame {
+  public:
+    AudioFrame(const AudioFrame&) = delete;
+
+    char* data() {
+        return buffer;
+    }
+
+    const char* data() const {
+        return buffer;
+    }
+
+    std::size_t size() const {
+        return length;
+    }
+
+    std::size_t capacity() const {
+        return buffer_capacity;
+    }
+
+    void set_size(std::size_t size_);
+
+    const AudioFormat& format() const {
+        return audio_format;
+    }
+
+    void set_format(const AudioFormat& format_) {
+        audio_format = format_;
+    }
+
+    // Monotonic time in microseconds when the first sample of frame was played into sink.
+    int64_t capture_time() const {
+        return capture_time_us;
+    }
+
+    void set_capture_time(int64_t capture_time_us_) {
+        capture_time_us = capture_time_us_;
+    }
+
+    // Whether frame contains only digital silence, receivers can synthesize it themselves.
+    bool silent() const {
+        return is_silent;
+    }
+
+    void set_silent(bool silent_) {
+        is_silent = silent_;
+    }
+
+  private:
+    AudioFrame(char* buffer_, std::size_t capacity_)
+            : buffer(buffer_), buffer_capacity(capacity_) {}
+
+    char* buffer;
+    std::size_t buffer_capacity;
+    std::size_t length = 0;
+    AudioFormat audio_format;
+    int64_t capture_time_us = 0;
+    bool is_silent = false;
+    std::atomic<int> refcount{0};
+    std::shared_ptr<AudioFramePool> pool;
+
+    friend class AudioFramePool;
+    friend class AudioFrameRef;
+};
+
+/*
+ * Reference counted handle to AudioFrame, when the last reference is gone frame is returned to
+ * its pool. Copying is just an atomic increment so it's cheap to pass frames between threads.
+ */
+class AudioFrameRef {
+  public:
+    AudioFrameRef() = default;
+
+    AudioFrameRef(const AudioFrameRef& other) : frame(other.frame) {
+        if (frame) frame->refcount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    AudioFrameRef(AudioFrameRef&& other) : frame(other.frame) {
+        other.frame = nullptr;
+    }
+
+    AudioFrameRef& operator=(AudioFrameRef other) {
+        std::swap(frame, other.frame);
+        return *this;
+    }
+
+    ~AudioFrameRef() {
+        reset();
+    }
+
+    void reset();
+
+    AudioFrame* get() const {
+        return frame;
+    }
+
+    AudioFrame* operator->() const {
+        return frame;
+    }
+
+    AudioFrame& operator*() const {
+        return *frame;
+    }
+
+    explicit operator bool() const {
+        return frame != nullptr;
+    }
+
+    int use_count() const {
+        return frame ? frame->refcount.load(std::memory_order_relaxed) : 0;
+    }
+
+  private:
+    explicit AudioFrameRef(AudioFrame* frame_) : frame(frame_) {
+        frame->refcount.store(1, std::memory_order_relaxed);
+    }
+
+    AudioFrame* frame = nullptr;
+
+    friend class AudioFramePool;
+};
+
+class AudioFramePool : public std::enable_shared_from_this<AudioFramePool> {
+  private:
+    struct private_tag {};
+
+  public:
+    struct Stats {
+        std::size_t frames = 0;
+        std::size_t frame_size = 0;
+        std::size_t in_use = 0;
+        std::size_t peak_in_use = 0;
+        uint64_t acquired = 0;
+        uint64_t exhausted = 0;
+    };
+
+    AudioFramePool(const AudioFramePool&) = delete;
+
+    AudioFramePool(std::size_t num_frames, std::size_t frame_size, private_tag);
+
+    static std::shared_ptr<AudioFramePool> create(std::size_t num_frames, std::size_t frame_size);
+
+    // Returns empty reference when all frames are in use.
+    AudioFrameRef acquire();
+
+    Stats get_stats() const;
+
+    std::size_t get_frame_size() const {
+        return frame_size;
+    }
+
+  private:
+    void release(AudioFrame* frame);
+
+    const std::size_t frame_size;
+    std::unique_ptr<char[]> memory;
+    std::vector<std::unique_ptr<AudioFrame>> frames;
+
+    mutable std::mutex mu;
+    std::vector<AudioFrame*> free_frames;
+    std::size_t peak_in_use = 0;
+    uint64_t acquired = 0, exhausted = 0;
+
+    friend class AudioFrameRef;
+};
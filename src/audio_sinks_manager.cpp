@@ -15,6 +15,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <mutex>
@@ -24,19 +26,45 @@
 
 #include <spdlog/spdlog.h>
 
+#include <gflags/gflags.h>
+
 #include <asio/io_service.hpp>
 
 #include <pulse/context.h>
 #include <pulse/error.h>
 #include <pulse/introspect.h>
+#include <pulse/sample.h>
 #include <pulse/stream.h>
 #include <pulse/subscribe.h>
 #include <pulse/volume.h>
 
+#include "audio_dsp.h"
 #include "audio_sinks_manager.h"
 #include "defer.h"
 #include "util.h"
 
+DEFINE_int32(frame_pool_size, 512, "number of preallocated audio frames shared by all sinks");
+DEFINE_int32(frame_pool_frame_size, 0,
+             "size in bytes of single preallocated audio frame, 0 to fit websocket frames of "
+             "--latency_profile and --device_latency_profiles");
+DEFINE_int32(sink_sample_rate, 48000, "sample rate of created PulseAudio sinks");
+DEFINE_string(sink_sample_format, "s16", "sample format of created sinks: s16, s24 or f32");
+DEFINE_string(latency_profile, "balanced",
+              "capture latency profile of all devices: low_latency, balanced or power_save");
+DEFINE_string(device_latency_profiles, "",
+              "latency profiles of single devices, comma separated list of name=profile");
+DEFINE_bool(suppress_silence, true,
+            "mark captured digital silence so it's not sent to receivers that understand it");
+
+static pa_sample_format_t get_pa_sample_format(SampleFormat format) {
+    switch (format) {
+        case SampleFormat::S16LE: return PA_SAMPLE_S16LE;
+        case SampleFormat::S24LE: return PA_SAMPLE_S24LE;
+        case SampleFormat::F32LE: return PA_SAMPLE_FLOAT32LE;
+    }
+    return PA_SAMPLE_INVALID;
+}
+
 struct ContextOperation {
     ContextOperation(AudioSinksManager* manager_, std::string name_, bool report_on_fail_ = true)
             : manager(manager_), name(name_), report_on_fail(report_on_fail_) {}
@@ -53,12 +81,75 @@ struct SinkInfoRequest {
 };
 
 AudioSinksManager::AudioSinksManager(asio::io_service& io_service_, const char* logger_name)
-        : io_service(io_service_), pa_mainloop(io_service), error_handler(nullptr),
+        : io_service(io_service_), pa_mainloop(io_service),
+          default_latency_profile(LatencyProfile::Type::BALANCED), error_handler(nullptr),
           default_sink_name(""), running(true), stopping(false) {
     logger = spdlog::get(logger_name);
+    if (!AudioFormat::parse_sample_format(FLAGS_sink_sample_format, &sink_format.sample_format)) {
+        logger->warn("(AudioSinkManager) Unknown sink sample format '{}', using '{}'",
+                     FLAGS_sink_sample_format, AudioFormat::get_name(sink_format.sample_format));
+    }
+    if (FLAGS_sink_sample_rate > 0 &&
+        static_cast<uint32_t>(FLAGS_sink_sample_rate) <= PA_RATE_MAX) {
+        sink_format.rate = static_cast<uint32_t>(FLAGS_sink_sample_rate);
+    } else {
+        logger->warn("(AudioSinkManager) Invalid sink sample rate {}, using {}",
+                     FLAGS_sink_sample_rate, sink_format.rate);
+    }
+    parse_latency_profiles();
+
+    // Pool is shared by all sinks, so it has to fit frames of the profile with longest frames.
+    uint32_t frame_ms = LatencyProfile::get(default_latency_profile).frame_ms;
+    for (const auto& device : device_latency_profiles) {
+        frame_ms = std::max(frame_ms, LatencyProfile::get(device.second).frame_ms);
+    }
+    // Big enough for a whole websocket frame even after switching to 32 bit samples.
+    AudioFormat widest = sink_format;
+    widest.sample_format = SampleFormat::F32LE;
+    std::size_t needed_size =
+            std::max<std::size_t>(4096, LatencyProfile::ms_to_bytes(frame_ms, widest));
+    std::size_t frame_size = static_cast<std::size_t>(std::max(0, FLAGS_frame_pool_frame_size));
+    if (frame_size == 0) {
+        frame_size = needed_size;
+    } else if (frame_size < needed_size) {
+        logger->warn("(AudioSinkManager) Frame pool frame size {} doesn't fit {}ms frames of "
+                     "latency profiles, they will be split into smaller websocket messages",
+                     frame_size, frame_ms);
+    }
+    frame_pool =
+            AudioFramePool::create(static_cast<std::size_t>(FLAGS_frame_pool_size), frame_size);
     pa_mainloop.set_loop_quit_callback([this](int retval) { mainloop_quit_handler(retval); });
 }
 
+void AudioSinksManager::parse_latency_profiles() {
+    if (!LatencyProfile::parse(FLAGS_latency_profile, &default_latency_profile)) {
+        logger->warn("(AudioSinkManager) Unknown latency profile '{}', using '{}'",
+                     FLAGS_latency_profile, LatencyProfile::get_name(default_latency_profile));
+    }
+
+    std::stringstream list(FLAGS_device_latency_profiles);
+    std::string entry;
+    while (std::getline(list, entry, ',')) {
+        if (entry.empty()) continue;
+        auto eq = entry.rfind('=');
+        LatencyProfile::Type type;
+        if (eq == std::string::npos || !LatencyProfile::parse(entry.substr(eq + 1), &type)) {
+            logger->warn("(AudioSinkManager) Invalid device latency profile '{}', ignoring",
+                         entry);
+            continue;
+        }
+        device_latency_profiles[entry.substr(0, eq)] = type;
+    }
+}
+
+LatencyProfile AudioSinksManager::get_latency_profile(const std::string& sink_name) const {
+    auto it = device_latency_profiles.find(sink_name);
+    if (it != device_latency_profiles.end()) {
+        return LatencyProfile::get(it->second);
+    }
+    return LatencyProfile::get(default_latency_profile);
+}
+
 void AudioSinksManager::start() {
     pa_mainloop.get_strand().post([this] { start_pa_connection(); });
 }
@@ -379,9 +470,11 @@ void AudioSinksManager::unregister_audio_sink(std::shared_ptr<InternalAudioSink>
 
 AudioSinksManager::InternalAudioSink::InternalAudioSink(AudioSinksManager* manager_,
                                                         std::string name_, std::string pretty_name_)
-        : manager(manager_), name(name_), pretty_name(pretty_name_),
+        : manager(manager_), stream(nullptr), format(manager->sink_format),
+          latency_profile(manager->get_latency_profile(name_)), restarting_stream(false),
+          name(name_), pretty_name(pretty_name_),
           sink_idx(static_cast<uint32_t>(-1)), state(State::NONE), default_sink(false),
-          activated(false), num_sink_inputs(0) {
+          activated(false), frame_pool_exhausted(false), num_sink_inputs(0) {
     identifier = generate_random_string(10);
     volume.channels = 0;
 }
@@ -412,6 +505,10 @@ void AudioSinksManager::InternalAudioSink::free(bool user) {
         case State::STARTED: /* Handled in module_load_callback */ break;
         case State::LOADED: stop_sink(); break;
         case State::RECORDING:
+            if (restarting_stream) {
+                // Stream is already disconnecting, stream_state_change_callback will stop sink.
+                break;
+            }
             if (pa_stream_disconnect(stream) < 0) {
                 manager->logger->error(
                         "(AudioSink '{}') Failed to start disconnecting stream {}: {}", name,
@@ -434,9 +531,13 @@ void AudioSinksManager::InternalAudioSink::start_sink() {
     state = State::STARTED;
     std::string escaped_name = replace_all(
             replace_all(replace_all(pretty_name, "\\", "\\\\"), " ", "\\ "), "\"", "\\\"");
+    const AudioFormat& sink_format = manager->sink_format;
     std::stringstream arguments;
     arguments << "sink_name=" << identifier
-              << " sink_properties=device.description=\"(Chromecast)\\ " << escaped_name << "\"";
+              << " sink_properties=device.description=\"(Chromecast)\\ " << escaped_name << "\""
+              << " rate=" << sink_format.rate << " channels=" << +sink_format.channels
+              << " format="
+              << pa_sample_format_to_string(get_pa_sample_format(sink_format.sample_format));
     pa_operation* op = pa_context_load_module(manager->context, "module-null-sink",
                                               arguments.str().c_str(), module_load_callback, this);
     if (op) {
@@ -484,48 +585,78 @@ void AudioSinksManager::InternalAudioSink::module_load_callback(pa_context* /*c*
     }
 
     sink->state = State::LOADED;
+    sink->start_record_stream();
+    if (sink->state == State::RECORDING) {
+        sink->update_sink_info();
+    }
+}
+
+void AudioSinksManager::InternalAudioSink::start_record_stream() {
+    assert(state == State::LOADED);
+    manager->logger->debug(
+            "(AudioSink '{}') Starting record stream, format: {} {}Hz, latency profile: {}", name,
+            AudioFormat::get_name(format.sample_format), format.rate,
+            LatencyProfile::get_name(latency_profile.type));
 
-    // Start record stream
+    // When format differs from the sink format PulseAudio converts samples on the server side.
     pa_sample_spec sample_spec;
-    sample_spec.format = PA_SAMPLE_S16LE;
-    sample_spec.channels = 2;
-    sample_spec.rate = 48000;
-    std::string stream_name = sink->identifier + "_record_stream";
-    sink->stream = pa_stream_new(sink->manager->context, stream_name.c_str(), &sample_spec, NULL);
-    if (!sink->stream) {
-        sink->manager->logger->error("(AudioSink '{}') Failed to create stream: {}", sink->name,
-                                     sink->manager->get_pa_error());
-        sink->free();
+    sample_spec.format = get_pa_sample_format(format.sample_format);
+    sample_spec.channels = format.channels;
+    sample_spec.rate = format.rate;
+    std::string stream_name = identifier + "_record_stream";
+    stream = pa_stream_new(manager->context, stream_name.c_str(), &sample_spec, NULL);
+    if (!stream) {
+        manager->logger->error("(AudioSink '{}') Failed to create stream: {}", name,
+                               manager->get_pa_error());
+        free();
         return;
     }
 
-    pa_stream_set_state_callback(sink->stream, stream_state_change_callback, sink);
-    pa_stream_set_read_callback(sink->stream, stream_read_callback, sink);
+    pa_stream_set_state_callback(stream, stream_state_change_callback, this);
+    pa_stream_set_read_callback(stream, stream_read_callback, this);
 
-    std::string device_name = sink->identifier + ".monitor";
+    std::string device_name = identifier + ".monitor";
     pa_buffer_attr buffer_attr;
-    // TODO: make buffer size configurable
     buffer_attr.fragsize =
-            (sample_spec.rate * sizeof(AudioSample)) / (1000 / 20);  // 20ms of buffer
-    buffer_attr.maxlength = static_cast<uint32_t>(-1);
+            static_cast<uint32_t>(LatencyProfile::ms_to_bytes(latency_profile.fragment_ms, format));
+    buffer_attr.maxlength = static_cast<uint32_t>(
+            LatencyProfile::ms_to_bytes(latency_profile.max_buffer_ms, format));
     buffer_attr.minreq = buffer_attr.prebuf = buffer_attr.tlength =
             static_cast<uint32_t>(-1);  // playback only arguments
-    pa_stream_flags_t stream_flags = static_cast<pa_stream_flags_t>(
-            PA_STREAM_DONT_MOVE | PA_STREAM_AUTO_TIMING_UPDATE | PA_STREAM_INTERPOLATE_TIMING |
-            PA_STREAM_START_UNMUTED | PA_STREAM_ADJUST_LATENCY);
-    if (pa_stream_connect_record(sink->stream, device_name.c_str(), &buffer_attr, stream_flags) <
-        0) {
-        pa_stream_unref(sink->stream);
-        sink->stream = nullptr;
-        sink->manager->logger->error("(AudioSink '{}') Failed to connect to stream: {}", sink->name,
-                                     sink->manager->get_pa_error());
-        sink->free();
+    // With ADJUST_LATENCY the source latency is lowered to fragsize, without it server keeps
+    // its own, usually much bigger, source latency and wakes up less often.
+    int stream_flags = PA_STREAM_DONT_MOVE | PA_STREAM_AUTO_TIMING_UPDATE |
+                       PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_START_UNMUTED;
+    if (latency_profile.adjust_latency) {
+        stream_flags |= PA_STREAM_ADJUST_LATENCY;
+    }
+    if (pa_stream_connect_record(stream, device_name.c_str(), &buffer_attr,
+                                 static_cast<pa_stream_flags_t>(stream_flags)) < 0) {
+        pa_stream_unref(stream);
+        stream = nullptr;
+        manager->logger->error("(AudioSink '{}') Failed to connect to stream: {}", name,
+                               manager->get_pa_error());
+        free();
         return;
     }
 
-    sink->state = State::RECORDING;
+    state = State::RECORDING;
+}
 
-    sink->update_sink_info();
+void AudioSinksManager::InternalAudioSink::set_format(AudioFormat format_) {
+    assert(manager->pa_mainloop.get_strand().running_in_this_thread());
+    if (format == format_) return;
+    format = format_;
+    if (state != State::RECORDING || restarting_stream) return;
+
+    // New stream is started with the new format after the old one terminates.
+    manager->logger->debug("(AudioSink '{}') Restarting record stream to change format", name);
+    restarting_stream = true;
+    if (pa_stream_disconnect(stream) < 0) {
+        manager->logger->error("(AudioSink '{}') Failed to start disconnecting stream: {}", name,
+                               manager->get_pa_error());
+        restarting_stream = false;
+    }
 }
 
 void AudioSinksManager::InternalAudioSink::update_sink_info() {
@@ -610,7 +741,13 @@ void AudioSinksManager::InternalAudioSink::stream_state_change_callback(pa_strea
         case PA_STREAM_TERMINATED:
             pa_stream_unref(sink->stream);
             sink->stream = nullptr;
-            sink->stop_sink();
+            if (sink->restarting_stream && sink->state == State::RECORDING) {
+                sink->restarting_stream = false;
+                sink->state = State::LOADED;
+                sink->start_record_stream();
+            } else {
+                sink->stop_sink();
+            }
             break;
         default: break;
     }
@@ -629,7 +766,8 @@ void AudioSinksManager::InternalAudioSink::stream_read_callback(pa_stream* /*str
         return;
     }
 
-    if (data_size % sizeof(AudioSample) != 0) {
+    const std::size_t frame_size = sink->format.get_frame_size();
+    if (data_size % frame_size != 0) {
         sink->manager->logger->warn("(AudioSink '{}') Not rounded sample data in buffer");
     }
 
@@ -640,8 +778,49 @@ void AudioSinksManager::InternalAudioSink::stream_read_callback(pa_stream* /*str
     }
 
     if (sink->samples_callback && sink->activated) {
-        sink->samples_callback(static_cast<const AudioSample*>(data),
-                               data_size / sizeof(AudioSample));
+        // Record latency is the time since the oldest sample in the buffer was played into sink.
+        int64_t capture_time = get_monotonic_time_us();
+        pa_usec_t latency;
+        int negative;
+        if (pa_stream_get_latency(sink->stream, &latency, &negative) == 0) {
+            int64_t latency_us = static_cast<int64_t>(latency);
+            capture_time += negative ? latency_us : -latency_us;
+        }
+
+        // Copy data to frames from pool once, from now on they are only passed by reference.
+        auto& pool = sink->manager->frame_pool;
+        // Every frame becomes single websocket message, so they are sized by latency profile.
+        std::size_t max_chunk = std::min(
+                pool->get_frame_size(),
+                LatencyProfile::ms_to_bytes(sink->latency_profile.frame_ms, sink->format));
+        max_chunk = std::max(max_chunk - max_chunk % frame_size, frame_size);
+        for (std::size_t offset = 0; offset < data_size; offset += max_chunk) {
+            std::size_t chunk = std::min(max_chunk, data_size - offset);
+            auto frame = pool->acquire();
+            if (!frame) {
+                if (!sink->frame_pool_exhausted) {
+                    sink->frame_pool_exhausted = true;
+                    auto stats = pool->get_stats();
+                    sink->manager->logger->warn(
+                            "(AudioSink '{}') Frame pool exhausted ({} of {} frames in use), "
+                            "dropping samples",
+                            sink->name, stats.in_use, stats.frames);
+                }
+                break;
+            }
+            sink->frame_pool_exhausted = false;
+            if (data == NULL) {
+                std::memset(frame->data(), 0, chunk);
+            } else {
+                std::memcpy(frame->data(), static_cast<const char*>(data) + offset, chunk);
+            }
+            frame->set_size(chunk);
+            frame->set_format(sink->format);
+            frame->set_capture_time(capture_time + sink->format.get_duration_us(offset));
+            frame->set_silent(FLAGS_suppress_silence &&
+                              (data == NULL || audio_dsp::is_zero(frame->data(), chunk)));
+            sink->samples_callback(std::move(frame));
+        }
     }
 
     if (pa_stream_drop(sink->stream) < 0) {
@@ -729,3 +908,8 @@ void AudioSink::set_volume_callback(
         sink = internal_audio_sink, volume_callback
     ] { sink->set_volume_callback(volume_callback); });
 }
+
+void AudioSink::set_format(AudioFormat format) {
+    internal_audio_sink->manager->pa_mainloop.get_strand().dispatch(
+            [ sink = internal_audio_sink, format ] { sink->set_format(format); });
+}
@@ -32,7 +32,11 @@
 #include <asio/io_service.hpp>
 
 #include "asio_pa_mainloop_api.h"
+#include "audio_format.h"
+#include "audio_frame_pool.h"
+#include "latency_profile.h"
 
+// Single point in time of S16LE stereo stream.
 struct AudioSample {
     int16_t left, right;
 };
@@ -62,10 +66,26 @@ class AudioSinksManager {
 
     std::shared_ptr<AudioSink> create_new_sink(std::string name, std::string pretty_name);
 
+    std::shared_ptr<AudioFramePool> get_frame_pool() const {
+        return frame_pool;
+    }
+
+    AudioFramePool::Stats get_frame_pool_stats() const {
+        return frame_pool->get_stats();
+    }
+
+    // Format in which audio is played into sinks by PulseAudio clients.
+    const AudioFormat& get_sink_format() const {
+        return sink_format;
+    }
+
+    // Profile from --device_latency_profiles for the device or --latency_profile.
+    LatencyProfile get_latency_profile(const std::string& sink_name) const;
+
   private:
     class InternalAudioSink : public std::enable_shared_from_this<InternalAudioSink> {
       public:
-        typedef std::function<void(const AudioSample*, size_t)> SamplesCallback;
+        typedef std::function<void(AudioFrameRef)> SamplesCallback;
         typedef std::function<void(double, double, bool)> VolumeCallback;
         typedef std::function<void(bool)> ActivationCallback;
 
@@ -78,6 +98,7 @@ class AudioSinksManager {
         void set_samples_callback(SamplesCallback);
         void set_activation_callback(ActivationCallback);
         void set_volume_callback(VolumeCallback);
+        void set_format(AudioFormat);
         void free(bool user = false);
         void start_sink();
 
@@ -92,6 +113,7 @@ class AudioSinksManager {
         static void module_unload_callback(pa_context* c, int success, void* userdata);
         static void stream_state_change_callback(pa_stream* stream, void* userdata);
         static void stream_read_callback(pa_stream* stream, size_t nbytes, void* userdata);
+        void start_record_stream();
         void stop_sink();
         static void sink_info_callback(pa_context* c, const pa_sink_info* info, int eol,
                                        void* userdata);
@@ -102,12 +124,16 @@ class AudioSinksManager {
         ActivationCallback activation_callback;
         VolumeCallback volume_callback;
         pa_stream* stream;
+        AudioFormat format;
+        LatencyProfile latency_profile;
+        bool restarting_stream;
         std::string name, pretty_name, identifier;
         uint32_t module_idx, sink_idx;
         pa_cvolume volume;
         bool muted;
         State state;
         bool default_sink, activated;
+        bool frame_pool_exhausted;
         int num_sink_inputs;
 
         friend class AudioSink;
@@ -133,10 +159,15 @@ class AudioSinksManager {
     void report_error(const std::string& message);
     std::string get_pa_error() const;
     void mainloop_quit_handler(int retval);
+    void parse_latency_profiles();
 
     asio::io_service& io_service;
     std::shared_ptr<spdlog::logger> logger;
     AsioPulseAudioMainloop pa_mainloop;
+    std::shared_ptr<AudioFramePool> frame_pool;
+    AudioFormat sink_format;
+    LatencyProfile::Type default_latency_profile;
+    std::unordered_map<std::string, LatencyProfile::Type> device_latency_profiles;
     ErrorHandler error_handler;
     // insert in AudioSinksManager::create_new_sink,
     // remove in AudioSinksManager::unregister_audio_sink
@@ -167,6 +198,9 @@ class AudioSink {
     void set_activation_callback(AudioSinksManager::InternalAudioSink::ActivationCallback);
     void set_volume_callback(AudioSinksManager::InternalAudioSink::VolumeCallback);
 
+    // Changes format of captured samples, PulseAudio converts them from sink format if needed.
+    void set_format(AudioFormat format);
+
   private:
     AudioSink(std::shared_ptr<AudioSinksManager::InternalAudioSink> internal_audio_sink_);
 
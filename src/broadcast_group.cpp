@@ -0,0 +1,152 @@
+/* broadcast_group.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "broadcast_group.h"
+
+static bool same_connection(const websocketpp::connection_hdl& a,
+                            const websocketpp::connection_hdl& b) {
+    std::owner_less<websocketpp::connection_hdl> less;
+    return !less(a, b) && !less(b, a);
+}
+
+void BroadcastGroup::add_subscriber(WebsocketBroadcaster::MessageHandler handler,
+                                    const AudioFormat& input_format) {
+    // Connection might have subscribed again, possibly with different codec.
+    remove_subscriber(handler.hdl);
+
+    auto it = std::find_if(encodings.begin(), encodings.end(), [&](const Encoding& e) {
+        return e.format == handler.format && e.encoder->get_config() == handler.codec;
+    });
+    if (it == encodings.end()) {
+        Encoding encoding{handler.format, nullptr, AudioEncoder::create(handler.codec, pool), {}};
+        update_converter(encoding, input_format);
+        encodings.push_back(std::move(encoding));
+        it = std::prev(encodings.end());
+    }
+    it->subscribers.push_back(handler);
+}
+
+void BroadcastGroup::update_converter(Encoding& encoding, const AudioFormat& input_format) {
+    if (input_format == encoding.format) {
+        encoding.converter.reset();
+    } else if (!encoding.converter || encoding.converter->get_in_format() != input_format) {
+        encoding.converter = std::make_unique<AudioConverter>(input_format, encoding.format, pool);
+    }
+}
+
+void BroadcastGroup::remove_subscriber(const websocketpp::connection_hdl& hdl) {
+    for (auto& encoding : encodings) {
+        auto& subs = encoding.subscribers;
+        subs.erase(std::remove_if(subs.begin(), subs.end(),
+                                  [&](const WebsocketBroadcaster::MessageHandler& h) {
+                                      return same_connection(h.hdl, hdl);
+                                  }),
+                   subs.end());
+    }
+    remove_unused_encodings();
+}
+
+void BroadcastGroup::remove_unused_encodings() {
+    encodings.erase(std::remove_if(encodings.begin(), encodings.end(),
+                                   [](const Encoding& e) { return e.subscribers.empty(); }),
+                    encodings.end());
+}
+
+void BroadcastGroup::broadcast(AudioFrameRef frame) {
+    if (replay_duration > 0 && encodings.empty()) {
+        keep_for_replay(std::move(frame));
+        return;
+    }
+    bool closed_connections = false;
+    for (auto& encoding : encodings) {
+        auto send = [&](AudioFrameRef out) {
+            for (auto& subscriber : encoding.subscribers) {
+                if (!WebsocketBroadcaster::send_frame(subscriber, out)) {
+                    subscriber.this_ptr = nullptr;
+                    closed_connections = true;
+                }
+            }
+        };
+        auto encode = [&](AudioFrameRef converted) {
+            encoding.encoder->encode(std::move(converted), send);
+        };
+
+        try {
+            update_converter(encoding, frame->format());
+        } catch (const ResamplerException&) {
+            // Only possible when capture format changed, subscriber gets nothing until it
+            // changes back.
+            continue;
+        }
+        if (encoding.converter) {
+            encoding.converter->convert(frame, encode);
+        } else {
+            encode(frame);
+        }
+    }
+
+    if (closed_connections) {
+        for (auto& encoding : encodings) {
+            auto& subs = encoding.subscribers;
+            subs.erase(std::remove_if(subs.begin(), subs.end(),
+                                      [](const WebsocketBroadcaster::MessageHandler& h) {
+                                          return h.this_ptr == nullptr;
+                                      }),
+                       subs.end());
+        }
+        remove_unused_encodings();
+    }
+}
+
+void BroadcastGroup::keep_for_replay(AudioFrameRef frame) {
+    replay_frames.push_back(std::move(frame));
+    const int64_t newest = replay_frames.back()->capture_time();
+    while (replay_frames.front()->capture_time() < newest - replay_duration) {
+        replay_frames.pop_front();
+    }
+    // Frames are shared by all sinks, capture of others is more important than replay.
+    auto stats = pool->get_stats();
+    if (stats.in_use > stats.frames / 2 && replay_frames.size() > 1) {
+        replay_frames.pop_front();
+    }
+}
+
+void BroadcastGroup::set_replay_duration(int64_t duration) {
+    replay_duration = duration;
+    if (replay_duration <= 0) {
+        replay_frames.clear();
+    }
+}
+
+void BroadcastGroup::flush_replay() {
+    std::deque<AudioFrameRef> frames;
+    frames.swap(replay_frames);
+    replay_duration = 0;
+    for (auto& frame : frames) {
+        broadcast(std::move(frame));
+    }
+}
+
+std::size_t BroadcastGroup::get_num_subscribers() const {
+    std::size_t num = 0;
+    for (auto& encoding : encodings) {
+        num += encoding.subscribers.size();
+    }
+    return num;
+}
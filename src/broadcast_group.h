@@ -0,0 +1,78 @@
+/* broadcast_group.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "audio_converter.h"
+#include "audio_encoder.h"
+#include "audio_format.h"
+#include "audio_frame_pool.h"
+#include "websocket_broadcaster.h"
+
+/*
+ * BroadcastGroup distributes audio of a single sink to all websocket connections subscribed to
+ * it. Frames are converted and encoded once for every distinct format and codec configuration
+ * and the same frame reference is handed to every subscriber using that configuration.
+ *
+ * BroadcastGroup is not thread safe, all calls have to be serialized by the caller.
+ */
+class BroadcastGroup {
+  public:
+    BroadcastGroup(const BroadcastGroup&) = delete;
+    BroadcastGroup(std::shared_ptr<AudioFramePool> pool_) : pool(pool_) {}
+
+    // Throws AudioEncoderException when encoder for subscriber's codec couldn't be created and
+    // ResamplerException when frames in input_format can't be converted to subscriber's format.
+    void add_subscriber(WebsocketBroadcaster::MessageHandler handler,
+                        const AudioFormat& input_format);
+    void broadcast(AudioFrameRef frame);
+
+    // While replay is enabled and there are no subscribers, frames of up to duration microseconds
+    // are kept instead of being dropped, 0 disables replay and drops kept frames.
+    void set_replay_duration(int64_t duration);
+
+    // Broadcasts kept frames to current subscribers and disables replay.
+    void flush_replay();
+
+    std::size_t get_num_subscribers() const;
+    std::size_t get_num_encodings() const {
+        return encodings.size();
+    }
+
+  private:
+    struct Encoding {
+        AudioFormat format;
+        std::unique_ptr<AudioConverter> converter;  // null when input is already in format
+        std::unique_ptr<AudioEncoder> encoder;
+        std::vector<WebsocketBroadcaster::MessageHandler> subscribers;
+    };
+
+    void remove_subscriber(const websocketpp::connection_hdl& hdl);
+    void remove_unused_encodings();
+    void update_converter(Encoding& encoding, const AudioFormat& input_format);
+    void keep_for_replay(AudioFrameRef frame);
+
+    std::shared_ptr<AudioFramePool> pool;
+    std::vector<Encoding> encodings;
+    int64_t replay_duration = 0;
+    std::deque<AudioFrameRef> replay_frames;
+};
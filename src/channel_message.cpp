@@ -0,0 +1,208 @@
+/* channel_message.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+
+#include "channel_message.h"
+
+namespace {
+
+/*
+ * Walks over top level of a JSON object without building anything. It's not a validator, it only
+ * has to find the keys correctly in valid JSON and not run past the end of invalid one.
+ */
+class Scanner {
+  public:
+    Scanner(const std::string& text) : p(text.data()), end(text.data() + text.size()) {}
+
+    bool consume(char c) {
+        skip_whitespace();
+        if (p == end || *p != c) {
+            return false;
+        }
+        ++p;
+        return true;
+    }
+
+    bool at(char c) {
+        skip_whitespace();
+        return p != end && *p == c;
+    }
+
+    // Reads string without escape sequences, they are left for the full parser.
+    bool read_simple_string(std::string* out) {
+        if (!at('"')) {
+            return false;
+        }
+        const char* start = p + 1;
+        if (!skip_string()) {
+            return false;
+        }
+        for (const char* c = start; c != p - 1; ++c) {
+            if (*c == '\\') {
+                return false;
+            }
+        }
+        out->assign(start, p - 1);
+        return true;
+    }
+
+    // Reads integer which is not followed by fraction or exponent.
+    bool read_int(int* out) {
+        skip_whitespace();
+        const char* start = p;
+        if (p != end && *p == '-') ++p;
+        const char* digits = p;
+        while (p != end && *p >= '0' && *p <= '9') ++p;
+        if (p == digits || p - digits > 9 || (p != end && (*p == '.' || *p == 'e' || *p == 'E'))) {
+            return false;
+        }
+        *out = std::atoi(std::string(start, p).c_str());
+        return true;
+    }
+
+    bool skip_string() {
+        skip_whitespace();
+        if (p == end || *p != '"') {
+            return false;
+        }
+        for (++p; p != end; ++p) {
+            if (*p == '\\') {
+                if (++p == end) break;
+            } else if (*p == '"') {
+                ++p;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool skip_value() {
+        skip_whitespace();
+        if (p == end) {
+            return false;
+        }
+        if (*p == '"') {
+            return skip_string();
+        }
+        if (*p == '{' || *p == '[') {
+            int depth = 0;
+            while (p != end) {
+                if (*p == '"') {
+                    if (!skip_string()) return false;
+                    continue;
+                }
+                if (*p == '{' || *p == '[') {
+                    ++depth;
+                } else if (*p == '}' || *p == ']') {
+                    if (--depth == 0) {
+                        ++p;
+                        return true;
+                    }
+                }
+                ++p;
+            }
+            return false;
+        }
+        // Number or literal.
+        const char* start = p;
+        while (p != end && *p != ',' && *p != '}' && *p != ']' && !is_whitespace(*p)) ++p;
+        return p != start;
+    }
+
+  private:
+    static bool is_whitespace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    void skip_whitespace() {
+        while (p != end && is_whitespace(*p)) ++p;
+    }
+
+    const char* p;
+    const char* end;
+};
+
+}  // namespace
+
+ChannelMessage::ChannelMessage(const std::string& payload_) : payload(payload_) {
+    if (!scan()) {
+        // Escaped keys, unusual numbers or invalid JSON, parser knows better.
+        scan_json();
+    }
+}
+
+bool ChannelMessage::scan() {
+    Scanner scanner(payload);
+    if (!scanner.consume('{')) {
+        return false;
+    }
+    if (scanner.consume('}')) {
+        object = true;
+        return true;
+    }
+    std::string key;
+    do {
+        if (!scanner.read_simple_string(&key) || !scanner.consume(':')) {
+            return false;
+        }
+        if (key == "type" && scanner.at('"')) {
+            if (!scanner.read_simple_string(&type)) return false;
+        } else if (key == "requestId" && !scanner.at('"')) {
+            if (!scanner.read_int(&request_id)) return false;
+            request_id_present = true;
+        } else if (!scanner.skip_value()) {
+            return false;
+        }
+    } while (scanner.consume(','));
+    if (!scanner.consume('}')) {
+        return false;
+    }
+    object = true;
+    return true;
+}
+
+void ChannelMessage::scan_json() {
+    type.clear();
+    request_id_present = false;
+    try {
+        const auto& msg = get_json();
+        if (!msg.is_object()) {
+            return;
+        }
+        object = true;
+        auto type_it = msg.find("type");
+        if (type_it != msg.end() && type_it->is_string()) {
+            type = type_it->get<std::string>();
+        }
+        auto request_id_it = msg.find("requestId");
+        if (request_id_it != msg.end() && request_id_it->is_number()) {
+            request_id = request_id_it->get<int>();
+            request_id_present = true;
+        }
+    } catch (std::invalid_argument) {
+        object = false;
+    }
+}
+
+const nlohmann::json& ChannelMessage::get_json() const {
+    if (!parsed) {
+        json = nlohmann::json::parse(payload);
+        parsed = true;
+    }
+    return json;
+}
@@ -0,0 +1,72 @@
+/* channel_message.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <json.hpp>
+
+/*
+ * ChannelMessage is JSON payload of a cast channel message. Most messages are handled by looking
+ * only at their "type" and "requestId", so these are found by a quick scan of top level keys of
+ * the payload and the whole payload is parsed only when it's requested by get_json. That way
+ * heartbeats and unsolicited status broadcasts, which are most of the traffic from busy receivers,
+ * are never fully parsed.
+ *
+ * Message keeps reference to the payload, so it has to outlive the message.
+ */
+class ChannelMessage {
+  public:
+    ChannelMessage(const ChannelMessage&) = delete;
+
+    explicit ChannelMessage(const std::string& payload_);
+
+    // False when payload is not a JSON object.
+    bool is_object() const {
+        return object;
+    }
+
+    // Empty when message doesn't have a string type.
+    const std::string& get_type() const {
+        return type;
+    }
+
+    bool has_request_id() const {
+        return request_id_present;
+    }
+
+    int get_request_id() const {
+        return request_id;
+    }
+
+    // Parses the whole payload on the first call. Throws std::invalid_argument when payload is not
+    // a valid JSON.
+    const nlohmann::json& get_json() const;
+
+  private:
+    bool scan();
+    void scan_json();
+
+    const std::string& payload;
+    bool object = false;
+    std::string type;
+    bool request_id_present = false;
+    int request_id = 0;
+    mutable bool parsed = false;
+    mutable nlohmann::json json;
+};
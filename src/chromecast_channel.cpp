@@ -15,27 +15,70 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdio>
+
+#include <gflags/gflags.h>
+
 #include "chromecast_channel.h"
 
-MainChromecastChannel::MainChromecastChannel(asio::io_service& io_service, std::string name_,
+DEFINE_int32(request_timeout, 5000, "milliseconds to wait for Chromecast response to a request");
+DEFINE_int32(launch_timeout, 20000, "milliseconds to wait for Chromecast to launch the app");
+DEFINE_int32(request_retries, 1, "number of times request is sent again after it timed out");
+DEFINE_int32(heartbeat_interval, 1000, "milliseconds between heartbeat PINGs sent to Chromecast");
+// Heartbeats notice a dead device in heartbeat_interval * heartbeat_max_missed, short enough to
+// fail over quickly while riding out a few seconds of Wi-Fi power save.
+DEFINE_int32(heartbeat_max_missed, 5,
+             "number of heartbeat PINGs in a row without answer after which Chromecast is "
+             "considered dead, 0 disables the check");
+
+// Longest PING payload of app namespace, with both numbers at their widest.
+static constexpr std::size_t max_ping_payload_size = 80;
+
+MainChromecastChannel::MainChromecastChannel(asio::io_service& io_service,
+                                             asio::io_service::strand strand_, std::string name_,
                                              std::string destination_, MessageFunc send_func_,
+                                             std::shared_ptr<RequestStats> request_stats,
                                              const char* logger_name, private_tag tag)
-        : BasicChromecastChannel<MainChromecastChannel>(io_service, name_, destination_, send_func_,
-                                                        logger_name, tag) {
+        : BasicChromecastChannel<MainChromecastChannel>(io_service, strand_, name_, destination_,
+                                                        send_func_, request_stats, logger_name,
+                                                        tag) {
     curr_request_id = 623453;
 
-    register_namespace_callback(CHCHANNS_RECEIVER,
-                                [this](nlohmann::json msg) { handle_receiver_channel(msg); });
+    register_namespace_callback(
+            CHCHANNS_RECEIVER, [this](const ChannelMessage& msg) { handle_receiver_channel(msg); });
 }
 
-void MainChromecastChannel::handle_receiver_channel(nlohmann::json msg) try {
-    auto req_it = pending_requests.find(msg["requestId"].get<int>());
+void MainChromecastChannel::handle_receiver_channel(const ChannelMessage& msg) {
+    if (!msg.has_request_id()) {
+        logger->warn("(MainChromecastChannel) JSON receiver ns, didn't have expected fields");
+        return;
+    }
+    // Unsolicited status broadcasts have requestId 0 and are dropped here without parsing.
+    auto req_it = pending_requests.find(msg.get_request_id());
     if (req_it != pending_requests.end()) {
-        req_it->second(msg);
+        complete_request(req_it->first);
+        auto callback = std::move(req_it->second);
         pending_requests.erase(req_it);
+        callback(msg.get_json());
     }
-} catch (std::domain_error) {
-    logger->warn("(MainChromecastChannel) JSON receiver ns, didn't have expected fields");
+}
+
+void MainChromecastChannel::send_receiver_request(nlohmann::json msg, int request_id,
+                                                  int64_t timeout_ms, StatusCb callback) {
+    pending_requests[request_id] = callback;
+    send_request(CHCHANNS_RECEIVER, msg, request_id, timeout_ms, FLAGS_request_retries,
+                 [this, request_id] { request_timed_out(request_id); });
+}
+
+void MainChromecastChannel::request_timed_out(int request_id) {
+    auto req_it = pending_requests.find(request_id);
+    if (req_it == pending_requests.end()) {
+        return;
+    }
+    logger->warn("(MainChromecastChannel) Request {} timed out", request_id);
+    auto callback = std::move(req_it->second);
+    pending_requests.erase(req_it);
+    callback({{"type", "TIMEOUT"}, {"requestId", request_id}});
 }
 
 void MainChromecastChannel::load_app(std::string app_id, StatusCb loaded_callback) {
@@ -43,8 +86,7 @@ void MainChromecastChannel::load_app(std::string app_id, StatusCb loaded_callbac
         int request_id = curr_request_id++;
         nlohmann::json load_msg = {
                 {"type", "LAUNCH"}, {"appId", app_id}, {"requestId", request_id}};
-        send_message(CHCHANNS_RECEIVER, load_msg);
-        pending_requests[request_id] = loaded_callback;
+        send_receiver_request(load_msg, request_id, FLAGS_launch_timeout, loaded_callback);
     });
 }
 
@@ -52,9 +94,8 @@ void MainChromecastChannel::stop_app(std::string session_id, StatusCb stopped_ca
     weak_dispatch([=] {
         int request_id = curr_request_id++;
         nlohmann::json load_msg = {
-                {"type", "LAUNCH"}, {"sessionId", session_id}, {"requestId", request_id}};
-        send_message(CHCHANNS_RECEIVER, load_msg);
-        pending_requests[request_id] = stopped_callback;
+                {"type", "STOP"}, {"sessionId", session_id}, {"requestId", request_id}};
+        send_receiver_request(load_msg, request_id, FLAGS_request_timeout, stopped_callback);
     });
 }
 
@@ -62,35 +103,131 @@ void MainChromecastChannel::get_status(StatusCb status_callback) {
     weak_dispatch([=] {
         int request_id = curr_request_id++;
         nlohmann::json load_msg = {{"type", "GET_STATUS"}, {"requestId", request_id}};
-        send_message(CHCHANNS_RECEIVER, load_msg);
-        pending_requests[request_id] = status_callback;
+        send_receiver_request(load_msg, request_id, FLAGS_request_timeout, status_callback);
     });
 }
 
-AppChromecastChannel::AppChromecastChannel(asio::io_service& io_service, std::string name_,
+AppChromecastChannel::AppChromecastChannel(asio::io_service& io_service,
+                                           asio::io_service::strand strand_, std::string name_,
                                            std::string destination_, MessageFunc send_func_,
+                                           std::shared_ptr<RequestStats> request_stats,
                                            const char* logger_name, private_tag tag)
-        : BasicChromecastChannel<AppChromecastChannel>(io_service, name_, destination_, send_func_,
-                                                       logger_name, tag) {
+        : BasicChromecastChannel<AppChromecastChannel>(io_service, strand_, name_, destination_,
+                                                       send_func_, request_stats, logger_name,
+                                                       tag) {
     curr_request_id = 1;
+    ping_message = make_message(CHCHANNS_STREAM_APP, std::string());
 
     register_namespace_callback(CHCHANNS_STREAM_APP,
-                                [this](nlohmann::json msg) { handle_app_channel(msg); });
+                                [this](const ChannelMessage& msg) { handle_app_channel(msg); });
+}
+
+void AppChromecastChannel::stop_stream(ResultCb result_callback) {
+    weak_dispatch([=] {
+        int request_id = curr_request_id++;
+        nlohmann::json stop_msg = {{"type", "STOP_STREAM"}, {"requestId", request_id}};
+        send_app_request(stop_msg, request_id, result_callback);
+    });
 }
 
-void AppChromecastChannel::handle_app_channel(nlohmann::json msg) try {
-    int request_id = msg["requestId"];
+void AppChromecastChannel::send_app_request(nlohmann::json msg, int request_id,
+                                            ResultCb callback) {
+    pending_requests[request_id] = callback;
+    send_request(CHCHANNS_STREAM_APP, msg, request_id, FLAGS_request_timeout,
+                 FLAGS_request_retries, [this, request_id] { request_timed_out(request_id); });
+}
+
+void AppChromecastChannel::request_timed_out(int request_id) {
+    auto req_it = pending_requests.find(request_id);
+    if (req_it == pending_requests.end()) {
+        return;
+    }
+    logger->warn("(AppChromecastChannel) Request {} timed out", request_id);
+    auto callback = std::move(req_it->second);
+    pending_requests.erase(req_it);
+    Result result(std::string("Request timed out"));
+    result.timeout = true;
+    callback(result);
+}
+
+void AppChromecastChannel::ping(PongCb pong_callback) {
+    weak_dispatch([=] {
+        int request_id = curr_request_id++;
+        int64_t t0 = get_monotonic_time_us();
+        // Formatted into payload of the same message every time, so its memory is reused.
+        std::string& payload = *ping_message.mutable_payload_utf8();
+        payload.resize(max_ping_payload_size);
+        int size = std::snprintf(&payload[0], payload.size() + 1,
+                                 "{\"type\":\"PING\",\"requestId\":%d,\"t0\":%lld}", request_id,
+                                 static_cast<long long>(t0));
+        payload.resize(static_cast<std::size_t>(size));
+        pending_pings[request_id] = std::make_pair(t0, pong_callback);
+        send_message(ping_message);
+        // Sent again it would carry stale t0, so it's not retried.
+        track_request(request_id, "PING", FLAGS_request_timeout, 0, nullptr,
+                      [this, request_id] { pending_pings.erase(request_id); });
+    });
+}
+
+void AppChromecastChannel::set_sync(int64_t clock_offset, int64_t playout_delay,
+                                    ResultCb result_callback) {
+    weak_dispatch([=] {
+        int request_id = curr_request_id++;
+        nlohmann::json sync_msg = {{"type", "SET_SYNC"},
+                                   {"requestId", request_id},
+                                   {"clockOffset", clock_offset},
+                                   {"playoutDelay", playout_delay}};
+        send_app_request(sync_msg, request_id, result_callback);
+    });
+}
+
+void AppChromecastChannel::handle_pong(const ChannelMessage& msg) {
+    int64_t t3 = get_monotonic_time_us();
+    int request_id = msg.get_request_id();
+    auto ping_it = pending_pings.find(request_id);
+    if (ping_it == pending_pings.end()) {
+        logger->debug("(AppChromecastChannel) Unexpected PONG requestId '{}'", request_id);
+        return;
+    }
+    complete_request(request_id);
+    // Callback runs on our strand and may send the next ping, so pending pings are settled first.
+    auto ping = std::move(ping_it->second);
+    // Pings sent before this one are not going to be answered anymore.
+    for (auto it = pending_pings.begin(); it != pending_pings.end();) {
+        if (it->first <= request_id) {
+            // Not a timeout, the receiver answered a newer ping.
+            cancel_request(it->first);
+            it = pending_pings.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    ping.second(msg.get_json(), ping.first, t3);
+}
+
+void AppChromecastChannel::handle_app_channel(const ChannelMessage& msg) try {
+    if (!msg.has_request_id()) {
+        logger->error("(AppChromecastChannel) JSON app ns, didn't have expected fields");
+        return;
+    }
+    const std::string& type = msg.get_type();
+    if (type == "PONG") {
+        handle_pong(msg);
+        return;
+    }
+    int request_id = msg.get_request_id();
     auto req_it = pending_requests.find(request_id);
     if (req_it != pending_requests.end()) {
-        std::string type = msg["type"];
+        complete_request(request_id);
+        auto callback = std::move(req_it->second);
+        pending_requests.erase(req_it);
         if (type == "OK") {
-            req_it->second(Result(msg["data"]));
+            callback(Result(msg.get_json().value("data", nlohmann::json())));
         } else if (type == "ERROR") {
-            req_it->second(Result(msg["message"].get<std::string>()));
+            callback(Result(msg.get_json().value("message", std::string())));
         } else {
             logger->error("(AppChromecastChannel) Unknown app ns response type '{}'", type);
         }
-        pending_requests.erase(req_it);
     } else {
         logger->error("(AppChromecastChannel) Unexpected requestId '{}'", request_id);
     }
@@ -31,6 +31,8 @@
 
 #include "proto/cast_channel.pb.h"
 
+#include "channel_message.h"
+#include "request_tracker.h"
 #include "util.h"
 
 constexpr const char* CHCHANNS_CONNECTION = "urn:x-cast:com.google.cast.tp.connection";
@@ -40,6 +42,9 @@ constexpr const char* CHCHANNS_STREAM_APP = "urn:x-cast:com.p2004a.chromecast-re
 
 /*
  * This class provides basic implementation of Chromecast virtual connection.
+ *
+ * Channel runs on the strand of its connection, so received messages are handled right away
+ * without being copied, and sent messages are passed on by reference.
  */
 template <class T>
 class BaseChromecastChannel : public std::enable_shared_from_this<T> {
@@ -47,25 +52,48 @@ class BaseChromecastChannel : public std::enable_shared_from_this<T> {
     struct private_tag {};
 
   public:
-    typedef std::function<void(cast_channel::CastMessage)> MessageFunc;
+    typedef std::function<void(const cast_channel::CastMessage&)> MessageFunc;
 
     BaseChromecastChannel(const BaseChromecastChannel&) = delete;
 
-    BaseChromecastChannel(asio::io_service& io_service, std::string name_, std::string destination_,
-                          MessageFunc send_func_, const char* logger_name, private_tag);
+    BaseChromecastChannel(asio::io_service& io_service, asio::io_service::strand strand_,
+                          std::string name_, std::string destination_, MessageFunc send_func_,
+                          std::shared_ptr<RequestStats> request_stats, const char* logger_name,
+                          private_tag);
 
-    static std::shared_ptr<T> create(asio::io_service& io_service, std::string name_,
+    static std::shared_ptr<T> create(asio::io_service& io_service,
+                                     asio::io_service::strand strand_, std::string name_,
                                      std::string destination_, MessageFunc send_func_,
+                                     std::shared_ptr<RequestStats> request_stats,
                                      const char* logger_name = "default");
 
-    void dispatch_message(cast_channel::CastMessage message);
+    // Has to be called on the channel strand.
+    void dispatch_message(const cast_channel::CastMessage& message);
 
   protected:
-    typedef std::function<void(nlohmann::json)> ParsedMessageFunc;
+    typedef std::function<void(const ChannelMessage&)> ParsedMessageFunc;
 
     void register_namespace_callback(std::string ns, ParsedMessageFunc func);
     void send_message(std::string ns, nlohmann::json msg);
 
+    // Frequent messages are built once with make_message and then reused, so they are sent
+    // without allocating.
+    cast_channel::CastMessage make_message(std::string ns, std::string payload) const;
+    void send_message(const cast_channel::CastMessage& message);
+
+    // Sends request and tracks its deadline. Request is sent again when it times out while it has
+    // retries left, then timeout_func is called.
+    void send_request(std::string ns, nlohmann::json msg, int request_id, int64_t timeout_ms,
+                      int retries, RequestTracker::TimeoutFunc timeout_func);
+
+    // Tracks deadline of request sent by other means than send_request.
+    void track_request(int request_id, std::string type, int64_t timeout_ms, int retries,
+                       RequestTracker::RetryFunc retry, RequestTracker::TimeoutFunc timeout_func);
+
+    // Returns false when request is not pending anymore.
+    bool complete_request(int request_id);
+    bool cancel_request(int request_id);
+
     std::shared_ptr<spdlog::logger> logger;
 
     template <class F>
@@ -80,33 +108,51 @@ class BaseChromecastChannel : public std::enable_shared_from_this<T> {
 
   private:
     void real_message_dispatch(const cast_channel::CastMessage& message);
+    void requests_timer_callback(const asio::error_code& error);
 
     std::unordered_map<std::string, ParsedMessageFunc> namespace_handlers;
     asio::io_service::strand strand;
     std::string name, destination;
     MessageFunc send_func;
+    RequestTracker requests;
+    asio::steady_timer requests_timer;  // ticks only while there are pending requests
+    bool requests_timer_running = false;
 };
 
 /*
  * This class implements two namespaces: urn:x-cast:com.google.cast.tp.connection and
  * urn:x-cast:com.google.cast.tp.heartbeat
+ *
+ * Receiver is considered dead when it doesn't answer a few PINGs in a row, and then the dead
+ * handler is called once.
  */
 template <class T>
 class BasicChromecastChannel : public BaseChromecastChannel<T> {
   public:
-    BasicChromecastChannel(asio::io_service& io_service, std::string name_,
-                           std::string destination_,
+    typedef std::function<void()> DeadFunc;
+
+    BasicChromecastChannel(asio::io_service& io_service, asio::io_service::strand strand_,
+                           std::string name_, std::string destination_,
                            typename BaseChromecastChannel<T>::MessageFunc send_func_,
-                           const char* logger_name, typename BaseChromecastChannel<T>::private_tag);
+                           std::shared_ptr<RequestStats> request_stats, const char* logger_name,
+                           typename BaseChromecastChannel<T>::private_tag);
 
     void start();
 
+    // Has to be set before start. Without it missed heartbeats are not checked at all.
+    void set_dead_handler(DeadFunc dead_handler_) {
+        dead_handler = dead_handler_;
+    }
+
   private:
-    void handle_connect_channel(nlohmann::json msg);
-    void handle_heartbeat_channel(nlohmann::json msg);
+    void handle_connect_channel(const ChannelMessage& msg);
+    void handle_heartbeat_channel(const ChannelMessage& msg);
     void timer_expired_callback(const asio::error_code& error);
 
     asio::steady_timer timer;
+    const cast_channel::CastMessage ping_message, pong_message;
+    int missed_pongs = 0;  // PINGs sent since receiver was last heard on heartbeat namespace
+    DeadFunc dead_handler = nullptr;
 };
 
 /*
@@ -116,15 +162,21 @@ class MainChromecastChannel : public BasicChromecastChannel<MainChromecastChanne
   public:
     typedef std::function<void(nlohmann::json msg)> StatusCb;
 
-    MainChromecastChannel(asio::io_service& io_service, std::string name_, std::string destination_,
-                          MessageFunc send_func_, const char* logger_name, private_tag);
+    MainChromecastChannel(asio::io_service& io_service, asio::io_service::strand strand_,
+                          std::string name_, std::string destination_, MessageFunc send_func_,
+                          std::shared_ptr<RequestStats> request_stats, const char* logger_name,
+                          private_tag);
 
+    // Callbacks get message with type TIMEOUT when receiver doesn't respond.
     void load_app(std::string app_id, StatusCb loaded_callback);
     void get_status(StatusCb status_callback);
     void stop_app(std::string session_id, StatusCb stopped_callback);
 
   private:
-    void handle_receiver_channel(nlohmann::json msg);
+    void handle_receiver_channel(const ChannelMessage& msg);
+    void send_receiver_request(nlohmann::json msg, int request_id, int64_t timeout_ms,
+                               StatusCb callback);
+    void request_timed_out(int request_id);
 
     int curr_request_id;
     std::unordered_map<int, StatusCb> pending_requests;
@@ -137,23 +189,41 @@ class AppChromecastChannel : public BasicChromecastChannel<AppChromecastChannel>
         Result(std::string message_) : ok(false), message(message_) {}
 
         bool ok;
+        bool timeout = false;  // receiver didn't respond
         nlohmann::json data;
         std::string message;
     };
 
     typedef std::function<void(Result)> ResultCb;
+    // Called with receiver response and sender times when PING was sent and PONG received, not
+    // called when PING times out.
+    typedef std::function<void(nlohmann::json pong, int64_t t0, int64_t t3)> PongCb;
 
-    AppChromecastChannel(asio::io_service& io_service, std::string name_, std::string destination_,
-                         MessageFunc send_func_, const char* logger_name, private_tag);
+    AppChromecastChannel(asio::io_service& io_service, asio::io_service::strand strand_,
+                         std::string name_, std::string destination_, MessageFunc send_func_,
+                         std::shared_ptr<RequestStats> request_stats, const char* logger_name,
+                         private_tag);
 
     template <class It>
     void start_stream(It begin, It end, std::string device_name, ResultCb);
 
+    void stop_stream(ResultCb result_callback);
+
+    void ping(PongCb pong_callback);
+
+    // Tells receiver to play samples captured at t at receiver time t + clock_offset + delay.
+    void set_sync(int64_t clock_offset, int64_t playout_delay, ResultCb result_callback);
+
   private:
-    void handle_app_channel(nlohmann::json msg);
+    void handle_app_channel(const ChannelMessage& msg);
+    void handle_pong(const ChannelMessage& msg);
+    void send_app_request(nlohmann::json msg, int request_id, ResultCb callback);
+    void request_timed_out(int request_id);
 
     int curr_request_id;
     std::unordered_map<int, ResultCb> pending_requests;
+    std::unordered_map<int, std::pair<int64_t, PongCb>> pending_pings;
+    cast_channel::CastMessage ping_message;  // payload is formatted in place for every PING
 };
 
 #include "chromecast_channel_impl.h"
@@ -16,30 +16,44 @@
  */
 
 #include <asio/ip/tcp.hpp>
+#include <cassert>
+#include <gflags/gflags.h>
 #include <sstream>
 
 #include "chromecast_channel.h"
 
+DECLARE_int32(heartbeat_interval);
+DECLARE_int32(heartbeat_max_missed);
+
 template <class T>
-BaseChromecastChannel<T>::BaseChromecastChannel(asio::io_service& io_service, std::string name_,
-                                                std::string destination_, MessageFunc send_func_,
+BaseChromecastChannel<T>::BaseChromecastChannel(asio::io_service& io_service,
+                                                asio::io_service::strand strand_,
+                                                std::string name_, std::string destination_,
+                                                MessageFunc send_func_,
+                                                std::shared_ptr<RequestStats> request_stats,
                                                 const char* logger_name, private_tag)
-        : strand(io_service), name(name_), destination(destination_), send_func(send_func_) {
+        : strand(strand_), name(name_), destination(destination_), send_func(send_func_),
+          requests(request_stats), requests_timer(io_service) {
     logger = spdlog::get(logger_name);
 }
 
 template <class T>
-std::shared_ptr<T> BaseChromecastChannel<T>::create(asio::io_service& io_service, std::string name_,
-                                                    std::string destination_,
+std::shared_ptr<T> BaseChromecastChannel<T>::create(asio::io_service& io_service,
+                                                    asio::io_service::strand strand_,
+                                                    std::string name_, std::string destination_,
                                                     MessageFunc send_func_,
+                                                    std::shared_ptr<RequestStats> request_stats,
                                                     const char* logger_name) {
-    return std::make_shared<T>(io_service, name_, destination_, send_func_, logger_name,
-                               private_tag{});
+    return std::make_shared<T>(io_service, strand_, name_, destination_, send_func_,
+                               request_stats, logger_name, private_tag{});
 }
 
 template <class T>
-void BaseChromecastChannel<T>::dispatch_message(cast_channel::CastMessage message) {
-    weak_dispatch([message, this] { real_message_dispatch(message); });
+void BaseChromecastChannel<T>::dispatch_message(const cast_channel::CastMessage& message) {
+    assert(strand.running_in_this_thread());
+    // Handlers may drop the last reference to us held by the owner.
+    auto this_ptr = this->shared_from_this();
+    real_message_dispatch(message);
 }
 
 template <class T>
@@ -56,8 +70,11 @@ void BaseChromecastChannel<T>::real_message_dispatch(const cast_channel::CastMes
         auto it = namespace_handlers.find(ns);
         if (it != namespace_handlers.end()) {
             try {
-                auto json_msg = nlohmann::json::parse(message.payload_utf8());
-                it->second(json_msg);
+                ChannelMessage channel_msg(message.payload_utf8());
+                if (!channel_msg.is_object()) {
+                    throw std::invalid_argument("payload is not an object");
+                }
+                it->second(channel_msg);
             } catch (std::invalid_argument) {
                 logger->warn("(BaseChromecastChannel) Couldn't parse message payload as JSON", ns);
             }
@@ -73,29 +90,94 @@ void BaseChromecastChannel<T>::register_namespace_callback(std::string ns, Parse
 }
 
 template <class T>
-void BaseChromecastChannel<T>::send_message(std::string ns, nlohmann::json msg) {
+cast_channel::CastMessage BaseChromecastChannel<T>::make_message(std::string ns,
+                                                                 std::string payload) const {
     cast_channel::CastMessage message;
     message.set_protocol_version(cast_channel::CastMessage_ProtocolVersion_CASTV2_1_0);
     message.set_source_id(name);
     message.set_destination_id(destination);
     message.set_namespace_(ns);
     message.set_payload_type(cast_channel::CastMessage_PayloadType_STRING);
-    message.set_payload_utf8(msg.dump());
+    message.set_payload_utf8(payload);
+    return message;
+}
 
+template <class T>
+void BaseChromecastChannel<T>::send_message(std::string ns, nlohmann::json msg) {
+    send_func(make_message(ns, msg.dump()));
+}
+
+template <class T>
+void BaseChromecastChannel<T>::send_message(const cast_channel::CastMessage& message) {
     send_func(message);
 }
 
+template <class T>
+void BaseChromecastChannel<T>::send_request(std::string ns, nlohmann::json msg, int request_id,
+                                            int64_t timeout_ms, int retries,
+                                            RequestTracker::TimeoutFunc timeout_func) {
+    std::string type = msg["type"];
+    send_message(ns, msg);
+    auto retry = [this, ns, msg, request_id] {
+        logger->debug("(BaseChromecastChannel) Retrying request {}", request_id);
+        send_message(ns, msg);
+    };
+    track_request(request_id, std::move(type), timeout_ms, retries, std::move(retry),
+                  std::move(timeout_func));
+}
+
+template <class T>
+void BaseChromecastChannel<T>::track_request(int request_id, std::string type, int64_t timeout_ms,
+                                             int retries, RequestTracker::RetryFunc retry,
+                                             RequestTracker::TimeoutFunc timeout_func) {
+    requests.add(request_id, std::move(type), timeout_ms * 1000, retries, std::move(retry),
+                 std::move(timeout_func), get_monotonic_time_us());
+    if (!requests_timer_running) {
+        requests_timer_running = true;
+        requests_timer_callback(asio::error_code());
+    }
+}
+
+template <class T>
+bool BaseChromecastChannel<T>::complete_request(int request_id) {
+    return requests.complete(request_id, get_monotonic_time_us());
+}
+
+template <class T>
+bool BaseChromecastChannel<T>::cancel_request(int request_id) {
+    return requests.cancel(request_id);
+}
+
+template <class T>
+void BaseChromecastChannel<T>::requests_timer_callback(const asio::error_code& error) {
+    if (error) return;
+    requests.advance(get_monotonic_time_us());
+    if (requests.empty()) {
+        requests_timer_running = false;
+        return;
+    }
+    requests_timer.expires_from_now(std::chrono::microseconds(RequestTracker::tick));
+    requests_timer.async_wait(
+            weak_wrap([this](const asio::error_code& error) { requests_timer_callback(error); }));
+}
+
 template <class T>
 BasicChromecastChannel<T>::BasicChromecastChannel(
-        asio::io_service& io_service, std::string name_, std::string destination_,
-        typename BaseChromecastChannel<T>::MessageFunc send_func_, const char* logger_name,
+        asio::io_service& io_service, asio::io_service::strand strand_, std::string name_,
+        std::string destination_, typename BaseChromecastChannel<T>::MessageFunc send_func_,
+        std::shared_ptr<RequestStats> request_stats, const char* logger_name,
         typename BaseChromecastChannel<T>::private_tag tag)
-        : BaseChromecastChannel<T>(io_service, name_, destination_, send_func_, logger_name, tag),
-          timer(io_service) {
-    this->register_namespace_callback(CHCHANNS_CONNECTION,
-                                      [this](nlohmann::json msg) { handle_connect_channel(msg); });
-    this->register_namespace_callback(
-            CHCHANNS_HEARTBEAT, [this](nlohmann::json msg) { handle_heartbeat_channel(msg); });
+        : BaseChromecastChannel<T>(io_service, strand_, name_, destination_, send_func_,
+                                   request_stats, logger_name, tag),
+          timer(io_service),
+          ping_message(this->make_message(CHCHANNS_HEARTBEAT, "{\"type\":\"PING\"}")),
+          pong_message(this->make_message(CHCHANNS_HEARTBEAT, "{\"type\":\"PONG\"}")) {
+    this->register_namespace_callback(CHCHANNS_CONNECTION, [this](const ChannelMessage& msg) {
+        handle_connect_channel(msg);
+    });
+    this->register_namespace_callback(CHCHANNS_HEARTBEAT, [this](const ChannelMessage& msg) {
+        handle_heartbeat_channel(msg);
+    });
 }
 
 template <class T>
@@ -109,8 +191,8 @@ void BasicChromecastChannel<T>::start() {
 }
 
 template <class T>
-void BasicChromecastChannel<T>::handle_connect_channel(nlohmann::json msg) try {
-    std::string type = msg["type"];
+void BasicChromecastChannel<T>::handle_connect_channel(const ChannelMessage& msg) {
+    const std::string& type = msg.get_type();
     this->logger->debug("(BasidChromecastChannel) Got quite unexpected {} message", type);
     if (type == "CONNECT") {
         // TODO: handle connect message, which is quite unexpected
@@ -119,33 +201,39 @@ void BasicChromecastChannel<T>::handle_connect_channel(nlohmann::json msg) try {
     } else {
         this->logger->warn("(BasidChromecastChannel) Unrecognized ns connect type: {}", type);
     }
-} catch (std::domain_error) {
-    this->logger->warn("(BasicChromecastChannel) JSON connect ns, didn't have expected fields");
 }
 
 template <class T>
-void BasicChromecastChannel<T>::handle_heartbeat_channel(nlohmann::json msg) try {
-    std::string type = msg["type"];
+void BasicChromecastChannel<T>::handle_heartbeat_channel(const ChannelMessage& msg) {
+    const std::string& type = msg.get_type();
     if (type == "PING") {
-        nlohmann::json pong_msg = {{"type", "PONG"}};
-        this->send_message(CHCHANNS_HEARTBEAT, pong_msg);
+        missed_pongs = 0;
+        this->send_message(pong_message);
     } else if (type == "PONG") {
-        // TODO: handle pong messages
+        missed_pongs = 0;
     } else {
         this->logger->warn("(BasidChromecastChannel) Unrecognized ns heartbeat type: {}", type);
     }
-} catch (std::domain_error) {
-    this->logger->warn("(BasicChromecastChannel) JSON heartbeat ns, didn't have expected fields");
 }
 
 template <class T>
 void BasicChromecastChannel<T>::timer_expired_callback(const asio::error_code& error) {
     if (error) return;
-    nlohmann::json ping_msg = {{"type", "PING"}};
-    this->send_message(CHCHANNS_HEARTBEAT, ping_msg);
+    // Channels without dead handler keep sending heartbeats, they are needed to keep the virtual
+    // connection open and the owner watches the receiver on another channel.
+    if (dead_handler && FLAGS_heartbeat_max_missed > 0 &&
+        missed_pongs >= FLAGS_heartbeat_max_missed) {
+        this->logger->warn("(BasicChromecastChannel) Receiver didn't answer {} heartbeats",
+                           missed_pongs);
+        if (dead_handler) {
+            dead_handler();
+        }
+        return;
+    }
+    this->send_message(ping_message);
+    ++missed_pongs;
 
-    // TODO: make this deadline configurable
-    timer.expires_from_now(std::chrono::seconds(20));
+    timer.expires_from_now(std::chrono::milliseconds(FLAGS_heartbeat_interval));
     timer.async_wait(this->weak_wrap(
             [this](const asio::error_code& error) { timer_expired_callback(error); }));
 }
@@ -153,9 +241,7 @@ void BasicChromecastChannel<T>::timer_expired_callback(const asio::error_code& e
 template <class It>
 void AppChromecastChannel::start_stream(It begin, It end, std::string device_name,
                                         ResultCb result_callback) {
-    int request_id = curr_request_id++;
     nlohmann::json start_stream_msg = {{"type", "START_STREAM"},
-                                       {"requestId", request_id},
                                        {"addresses", nlohmann::json::array()},
                                        {"deviceName", device_name}};
     for (It it = begin; it != end; ++it) {
@@ -165,6 +251,9 @@ void AppChromecastChannel::start_stream(It begin, It end, std::string device_nam
 
         start_stream_msg["addresses"].push_back(ss.str());
     }
-    pending_requests[request_id] = result_callback;
-    send_message(CHCHANNS_STREAM_APP, start_stream_msg);
-}
+    weak_dispatch([=]() mutable {
+        int request_id = curr_request_id++;
+        start_stream_msg["requestId"] = request_id;
+        send_app_request(start_stream_msg, request_id, result_callback);
+    });
+}
\ No newline at end of file
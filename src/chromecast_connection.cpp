@@ -16,33 +16,65 @@
  */
 
 #include <endian.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
 #include <asio/io_service.hpp>
 #include <asio/ip/tcp.hpp>
 #include <asio/read.hpp>
 #include <asio/ssl.hpp>
 #include <asio/write.hpp>
+#include <gflags/gflags.h>
 
 #include "proto/cast_channel.pb.h"
 
 #include "chromecast_connection.h"
+#include "util.h"
+
+DEFINE_int32(max_write_batch, 16384,
+             "maximum size in bytes of messages coalesced into a single write to Chromecast, "
+             "0 disables coalescing");
+
+/*
+ * Lower values notice a dead device sooner, but Wi-Fi devices in power save routinely stall for a
+ * few seconds and every false alarm costs a reconnect and app relaunch, so defaults stay around
+ * ten seconds. Heartbeats of the cast channel detect dead devices faster anyway.
+ */
+DEFINE_int32(tcp_keepalive_idle, 5,
+             "seconds without data from Chromecast before TCP keepalive probes are sent, "
+             "0 disables keepalive");
+DEFINE_int32(tcp_keepalive_interval, 2, "seconds between TCP keepalive probes");
+DEFINE_int32(tcp_keepalive_count, 3,
+             "number of unanswered TCP keepalive probes after which connection is dropped");
+DEFINE_int32(tcp_user_timeout, 10000,
+             "milliseconds sent data may stay unacknowledged before connection is dropped, "
+             "0 uses the system default");
+
+// Maximum number of write buffers kept for reuse, more are needed only during bursts.
+static constexpr std::size_t max_free_write_buffers = 8;
 
 // TODO: add tcp and tls connection timeout
 
 ChromecastConnection::ChromecastConnection(asio::io_service& io_service_,
+                                           asio::io_service::strand strand_,
+                                           std::shared_ptr<TlsClientContext> tls_context_,
                                            asio::ip::tcp::endpoint endpoint_,
                                            const char* logger_name, private_tag)
-        : io_service(io_service_), strand(io_service),
-          ssl_context(asio::ssl::context::sslv23_client), socket(io_service, ssl_context),
-          endpoint(endpoint_) {
+        : io_service(io_service_), strand(strand_), tls_context(tls_context_),
+          socket(io_service, tls_context->get_context()), endpoint(endpoint_), messages_sent(0),
+          bytes_sent(0), batches_sent(0) {
     logger = spdlog::get(logger_name);
 }
 
-std::shared_ptr<ChromecastConnection> ChromecastConnection::create(asio::io_service& io_service,
-                                                                   asio::ip::tcp::endpoint endpoint,
-                                                                   const char* logger_name) {
-    return std::make_shared<ChromecastConnection>(io_service, endpoint, logger_name, private_tag{});
+std::shared_ptr<ChromecastConnection> ChromecastConnection::create(
+        asio::io_service& io_service, asio::io_service::strand strand,
+        std::shared_ptr<TlsClientContext> tls_context, asio::ip::tcp::endpoint endpoint,
+        const char* logger_name) {
+    return std::make_shared<ChromecastConnection>(io_service, strand, tls_context, endpoint,
+                                                  logger_name, private_tag{});
 }
 
 void ChromecastConnection::start() {
@@ -55,14 +87,17 @@ void ChromecastConnection::start() {
 
     strand.dispatch([ this, this_ptr = shared_from_this() ] {
         if (is_stopped) return;
+        phase_start_time = get_monotonic_time_us();
         socket.lowest_layer().async_connect(
                 endpoint, strand.wrap([ this, this_ptr = shared_from_this() ](
                                   const asio::error_code& error) { connect_handler(error); }));
     });
 }
 
+// Posted, as it's usually called from our own handlers and has to cancel the read started after
+// them.
 void ChromecastConnection::stop() {
-    strand.dispatch([ this, this_ptr = shared_from_this() ] {
+    strand.post([ this, this_ptr = shared_from_this() ] {
         if (is_stopped) {
             logger->warn("(ChromecastConnection) Requested to stop already stopped connection.");
         } else {
@@ -73,20 +108,63 @@ void ChromecastConnection::stop() {
     });
 }
 
+void ChromecastConnection::abort() {
+    strand.dispatch([ this, this_ptr = shared_from_this() ] {
+        logger->trace("(ChromecastConnection) Aborting");
+        is_stopped = true;
+        notify_disconnect = false;
+        close_socket();
+    });
+}
+
 void ChromecastConnection::report_error(std::string message) {
     assert(strand.running_in_this_thread());
     is_stopped = true;
     notify_disconnect = false;
+    close_socket();
+    error_handler(message);
+}
+
+void ChromecastConnection::close_socket() {
     socket.lowest_layer().cancel();
     if (socket.lowest_layer().is_open()) {
         asio::error_code ec;
         socket.lowest_layer().close(ec);
         if (ec) {
-            logger->error("(ChromecastConnection) Error while closing socket because of error: {}",
-                          ec.message());
+            logger->error("(ChromecastConnection) Error while closing socket: {}", ec.message());
+        }
+    }
+}
+
+/*
+ * Keepalive finds dead peers of idle connections and user timeout of connections with unanswered
+ * data, so a powered off device breaks the connection in seconds and not after minutes of
+ * retransmissions. They are set independently, user timeout doesn't depend on keepalive flags.
+ */
+void ChromecastConnection::set_keepalive_options() {
+    typedef asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE> keep_idle;
+    typedef asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPINTVL> keep_interval;
+    typedef asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPCNT> keep_count;
+    typedef asio::detail::socket_option::integer<IPPROTO_TCP, TCP_USER_TIMEOUT> user_timeout;
+    asio::error_code ec;
+    auto& tcp_socket = socket.lowest_layer();
+    if (FLAGS_tcp_keepalive_idle > 0) {
+        tcp_socket.set_option(asio::socket_base::keep_alive(true), ec);
+        if (!ec) tcp_socket.set_option(keep_idle(FLAGS_tcp_keepalive_idle), ec);
+        if (!ec) tcp_socket.set_option(keep_interval(FLAGS_tcp_keepalive_interval), ec);
+        if (!ec) tcp_socket.set_option(keep_count(FLAGS_tcp_keepalive_count), ec);
+        if (ec) {
+            logger->warn("(ChromecastConnection) Failed to set TCP keepalive options: {}",
+                         ec.message());
+        }
+    }
+    if (FLAGS_tcp_user_timeout > 0) {
+        tcp_socket.set_option(user_timeout(FLAGS_tcp_user_timeout), ec);
+        if (ec) {
+            logger->warn("(ChromecastConnection) Failed to set TCP user timeout: {}",
+                         ec.message());
         }
     }
-    error_handler(message);
 }
 
 void ChromecastConnection::shutdown_tcp() {
@@ -140,13 +218,18 @@ void ChromecastConnection::connect_handler(const asio::error_code& error) {
         return;
     }
 
-    logger->trace("(ChromecastConnection) Opened TCP connection");
+    int64_t now = get_monotonic_time_us();
+    logger->debug("(ChromecastConnection) Opened TCP connection to {} in {}ms",
+                  endpoint.address().to_string(), (now - phase_start_time) / 1000);
     if (is_stopped) {
         shutdown_tcp();
     } else {
         asio::ip::tcp::no_delay option(true);
         socket.lowest_layer().set_option(option);
+        set_keepalive_options();
 
+        phase_start_time = now;
+        session_offered = tls_context->prepare_handshake(socket.native_handle(), endpoint);
         socket.async_handshake(asio::ssl::stream_base::client, strand.wrap([
             this, this_ptr = shared_from_this()
         ](const asio::error_code& error_) { handshake_handler(error_); }));
@@ -156,13 +239,23 @@ void ChromecastConnection::connect_handler(const asio::error_code& error) {
 void ChromecastConnection::handshake_handler(const asio::error_code& error) {
     assert(strand.running_in_this_thread());
     if (error && error != asio::error::operation_aborted) {
+        if (session_offered) {
+            // Don't offer the same session again in case device didn't like it.
+            tls_context->remove_session(endpoint);
+        }
         report_error("TLS handshake failed: " + error.message());
     } else if (error) {  // it is asio::error::operation_aborted
         shutdown_tcp();
     } else if (is_stopped) {
         shutdown_tls();
     } else {
-        logger->trace("(ChromecastConnection) Opened TLS connection");
+        int64_t duration = get_monotonic_time_us() - phase_start_time;
+        bool resumed = tls_context->handshake_done(socket.native_handle(), duration);
+        logger->info("(ChromecastConnection) Opened TLS connection to {} in {}ms, {}",
+                     endpoint.address().to_string(), duration / 1000,
+                     resumed ? "session resumed"
+                             : session_offered ? "full handshake, session not resumed"
+                                               : "full handshake");
         notify_disconnect = true;
         connected_handler(true);
         read_message();
@@ -189,6 +282,9 @@ void ChromecastConnection::read_op_handle_error_and_stop(const asio::error_code&
         } else {
             logger->trace("ChromecastConnection) Peer closed TCP connection");
         }
+    } else if (!socket.lowest_layer().is_open()) {
+        // Closed because of an error or abort, there is nothing to shut down.
+        return;
     } else if (error == asio::error::operation_aborted || is_stopped) {
         shutdown_tls();
     } else {
@@ -213,12 +309,9 @@ void ChromecastConnection::handle_header_read(const asio::error_code& error) {
             report_error("Received too big message: " + std::to_string(length));
             return;
         }
-        if (read_buffer_size < length) {
-            read_buffer_size = static_cast<std::size_t>(length * 1.5);
-            read_buffer.reset(new char[read_buffer_size]);
-        }
-        assert(read_buffer != nullptr);
-        asio::async_read(socket, asio::buffer(read_buffer.get(), length),
+        // Capacity only grows, so after the biggest message was seen it's never reallocated.
+        read_buffer.resize(length);
+        asio::async_read(socket, asio::buffer(read_buffer),
                          strand.wrap([ this, this_ptr = shared_from_this() ](
                                  const asio::error_code& error_, std::size_t size) {
                              handle_message_data_read(error_, size);
@@ -232,50 +325,111 @@ void ChromecastConnection::handle_message_data_read(const asio::error_code& erro
     if (error || is_stopped) {
         read_op_handle_error_and_stop(error);
     } else {
-        cast_channel::CastMessage message;
-        message.ParseFromArray(read_buffer.get(), size);
-        // TODO: what if deserialiation fails?
-        logger->trace("(ChromecastConnection) Received message\n{}", message.DebugString());
-        messages_handler(std::move(message));
+        // Parsing into the same message reuses memory of its strings.
+        if (!received_message.ParseFromArray(read_buffer.data(), static_cast<int>(size))) {
+            logger->warn("(ChromecastConnection) Failed to parse message of {} bytes", size);
+        } else {
+            if (logger->should_log(spdlog::level::trace)) {
+                logger->trace("(ChromecastConnection) Received message\n{}",
+                              received_message.DebugString());
+            }
+            messages_handler(received_message);
+        }
         read_message();
     }
 }
 
 void ChromecastConnection::send_message(const cast_channel::CastMessage& message) {
-    std::size_t buffer_size = sizeof(uint32_t) + message.ByteSize();
-    std::shared_ptr<char> data(new char[buffer_size], std::default_delete<char[]>());
+    if (logger->should_log(spdlog::level::trace)) {
+        logger->trace("(ChromecastConnection) Sending message\n{}", message.DebugString());
+    }
 
-    *reinterpret_cast<uint32_t*>(data.get()) = htobe32(static_cast<uint32_t>(message.ByteSize()));
-    // TODO: Can serialization fail?
-    message.SerializeToArray(data.get() + sizeof(uint32_t), message.ByteSize());
+    if (strand.running_in_this_thread()) {
+        queue_message(message);
+    } else {
+        strand.dispatch([ this, message, this_ptr = shared_from_this() ] {
+            queue_message(message);
+        });
+    }
+}
 
-    logger->trace("(ChromecastConnection) Sending message\n{}", message.DebugString());
+void ChromecastConnection::queue_message(const cast_channel::CastMessage& message) {
+    assert(strand.running_in_this_thread());
+    if (is_stopped) return;
+    // Size computed here is cached in message and used by serialization.
+    const std::size_t size = message.ByteSizeLong();
+    const std::size_t framed_size = sizeof(uint32_t) + size;
+    // Batch at the front is already being written, so only later ones can be extended.
+    if (write_queue.size() < 2 ||
+        write_queue.back().data.size() + framed_size >
+                static_cast<std::size_t>(std::max(FLAGS_max_write_batch, 0))) {
+        write_queue.push_back(WriteBatch{acquire_write_buffer(), 0});
+    }
+    auto& batch = write_queue.back();
+    const std::size_t offset = batch.data.size();
+    batch.data.resize(offset + framed_size);
+    const uint32_t be_size = htobe32(static_cast<uint32_t>(size));
+    std::memcpy(batch.data.data() + offset, &be_size, sizeof(be_size));
+    message.SerializeWithCachedSizesToArray(
+            reinterpret_cast<uint8_t*>(batch.data.data() + offset + sizeof(uint32_t)));
+    ++batch.messages;
+    if (write_queue.size() == 1) {
+        write_from_queue();
+    }
+}
 
-    strand.dispatch([ this, data = std::move(data), buffer_size, this_ptr = shared_from_this() ] {
-        if (is_stopped) return;
-        write_queue.emplace_back(std::move(data), buffer_size);
-        if (write_queue.size() == 1) {
-            write_from_queue();
-        }
-    });
+std::vector<char> ChromecastConnection::acquire_write_buffer() {
+    assert(strand.running_in_this_thread());
+    if (free_write_buffers.empty()) {
+        return std::vector<char>();
+    }
+    auto buffer = std::move(free_write_buffers.back());
+    free_write_buffers.pop_back();
+    return buffer;
 }
 
+/*
+ * Length prefixes and messages are in one buffer rather than gathered from many: TLS stream writes
+ * only the first buffer of a sequence at once, so every piece would get a TLS record of its own.
+ */
 void ChromecastConnection::write_from_queue() {
     assert(strand.running_in_this_thread());
-    auto& buff = write_queue.front();
-
-    asio::async_write(socket, asio::buffer(buff.first.get(), buff.second),
+    asio::async_write(socket, asio::buffer(write_queue.front().data),
                       strand.wrap([ this, this_ptr = shared_from_this() ](
                               const asio::error_code& error, const size_t) {
-                          if (error) {
-                              if (error != asio::error::operation_aborted) {
-                                  report_error("Writing data to socket failed: " + error.message());
-                              }
-                          } else {
-                              write_queue.pop_front();
-                              if (!write_queue.empty() && !is_stopped) {
-                                  write_from_queue();
-                              }
-                          }
+                          handle_write(error);
                       }));
 }
+
+void ChromecastConnection::handle_write(const asio::error_code& error) {
+    if (error) {
+        if (error != asio::error::operation_aborted) {
+            report_error("Writing data to socket failed: " + error.message());
+        }
+        return;
+    }
+    auto& batch = write_queue.front();
+    messages_sent += batch.messages;
+    bytes_sent += batch.data.size();
+    ++batches_sent;
+    if (batch.messages > 1) {
+        logger->trace("(ChromecastConnection) Wrote {} messages in a single batch",
+                      batch.messages);
+    }
+    if (free_write_buffers.size() < max_free_write_buffers) {
+        batch.data.clear();
+        free_write_buffers.push_back(std::move(batch.data));
+    }
+    write_queue.pop_front();
+    if (!write_queue.empty() && !is_stopped) {
+        write_from_queue();
+    }
+}
+
+ChromecastConnection::Stats ChromecastConnection::get_stats() const {
+    Stats stats;
+    stats.messages_sent = messages_sent;
+    stats.bytes_sent = bytes_sent;
+    stats.batches_sent = batches_sent;
+    return stats;
+}
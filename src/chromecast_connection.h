@@ -17,10 +17,13 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <spdlog/spdlog.h>
 
@@ -32,6 +35,8 @@
 
 #include "proto/cast_channel.pb.h"
 
+#include "tls_client_context.h"
+
 /* ChromecastConnection is used to communicate with Chromecast device.
  *
  * After error you will never receive any notifications and connection will be automatically closed
@@ -40,6 +45,9 @@
  * error or both notifications. You can always call stop.
  *
  * Calling stop when it is not necessary results in a warning.
+ *
+ * Connection runs on the strand it's given, which is normally shared with its owner, so handlers
+ * are called directly on that strand and messages are not copied on their way in or out.
  */
 
 class ChromecastConnection : public std::enable_shared_from_this<ChromecastConnection> {
@@ -49,21 +57,37 @@ class ChromecastConnection : public std::enable_shared_from_this<ChromecastConne
   public:
     typedef std::function<void(std::string)> ErrorHandler;
     typedef std::function<void(bool)> ConnectedHandler;
-    typedef std::function<void(cast_channel::CastMessage)> MessagesHandler;
+    // Message is only valid during the call, it's reused for the next one.
+    typedef std::function<void(const cast_channel::CastMessage&)> MessagesHandler;
+
+    struct Stats {
+        uint64_t messages_sent = 0;
+        uint64_t bytes_sent = 0;  // including length prefixes
+        uint64_t batches_sent = 0;  // socket writes, each with one or more messages
+    };
 
     ChromecastConnection(const ChromecastConnection&) = delete;
 
-    static std::shared_ptr<ChromecastConnection> create(asio::io_service&, asio::ip::tcp::endpoint,
+    static std::shared_ptr<ChromecastConnection> create(asio::io_service&,
+                                                        asio::io_service::strand,
+                                                        std::shared_ptr<TlsClientContext>,
+                                                        asio::ip::tcp::endpoint,
                                                         const char* logger_name = "default");
 
-    ChromecastConnection(asio::io_service&, asio::ip::tcp::endpoint, const char* logger_name,
-                         private_tag);
+    ChromecastConnection(asio::io_service&, asio::io_service::strand,
+                         std::shared_ptr<TlsClientContext>, asio::ip::tcp::endpoint,
+                         const char* logger_name, private_tag);
 
+    // Message is serialized right away when called on the connection strand, copied otherwise.
     void send_message(const cast_channel::CastMessage& message);
 
     void start();
     void stop();
 
+    // Closes the socket right away without TLS shutdown, for peers that stopped responding.
+    // No notifications are received after abort.
+    void abort();
+
     void set_error_handler(ErrorHandler error_handler_) {
         error_handler = error_handler_;
     }
@@ -76,15 +100,23 @@ class ChromecastConnection : public std::enable_shared_from_this<ChromecastConne
         messages_handler = messages_handler_;
     }
 
+    // Can be called from any thread.
+    Stats get_stats() const;
+
   private:
     void connect_handler(const asio::error_code& error);
     void handshake_handler(const asio::error_code& error);
     void report_error(std::string message);
+    void close_socket();
+    void set_keepalive_options();
     bool is_connection_end(const asio::error_code& error);
     void read_op_handle_error_and_stop(const asio::error_code& error);
     void shutdown_tcp();
     void shutdown_tls();
+    void queue_message(const cast_channel::CastMessage& message);
     void write_from_queue();
+    void handle_write(const asio::error_code& error);
+    std::vector<char> acquire_write_buffer();
     void read_message();
     void handle_header_read(const asio::error_code& error);
     void handle_message_data_read(const asio::error_code& error, std::size_t size);
@@ -92,7 +124,7 @@ class ChromecastConnection : public std::enable_shared_from_this<ChromecastConne
     std::shared_ptr<spdlog::logger> logger;
     asio::io_service& io_service;
     asio::io_service::strand strand;
-    asio::ssl::context ssl_context;
+    std::shared_ptr<TlsClientContext> tls_context;
     asio::ssl::stream<asio::ip::tcp::socket> socket;
     asio::ip::tcp::endpoint endpoint;
     ErrorHandler error_handler = nullptr;
@@ -100,12 +132,23 @@ class ChromecastConnection : public std::enable_shared_from_this<ChromecastConne
     ConnectedHandler connected_handler = nullptr;
     bool is_stopped = false;
     bool notify_disconnect = false;
-
-    std::deque<std::pair<std::shared_ptr<char>, std::size_t>> write_queue;
+    int64_t phase_start_time = 0;  // start of TCP connect or TLS handshake, for timing logs
+    bool session_offered = false;  // whether cached TLS session was offered in handshake
+
+    // Messages are serialized together with their length prefix into batches which are reused
+    // once written. With the reused read buffer and message, steady traffic doesn't allocate.
+    // The front batch is being written, messages sent meanwhile are appended to the back one.
+    struct WriteBatch {
+        std::vector<char> data;
+        std::size_t messages = 0;
+    };
+    std::deque<WriteBatch> write_queue;
+    std::vector<std::vector<char>> free_write_buffers;
+    std::atomic<uint64_t> messages_sent, bytes_sent, batches_sent;
     union {
         char data[4];
         uint32_t be_length;
     } message_header;
-    std::unique_ptr<char[]> read_buffer;
-    std::size_t read_buffer_size = 0;
+    std::vector<char> read_buffer;
+    cast_channel::CastMessage received_message;
 };
\ No newline at end of file
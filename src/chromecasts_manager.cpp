@@ -15,7 +15,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <chrono>
 #include <functional>
+#include <sstream>
+#include <thread>
 
 #include <gflags/gflags.h>
 
@@ -23,17 +27,76 @@
 #include "network_address.h"
 
 DEFINE_string(chromecast_app_id, "10600AB8", "id of the app to load to Chromecast");
+DEFINE_int32(samples_ring_size, 64, "number of audio frames buffered between capture and sender");
+DEFINE_int32(clock_sync_interval, 2000,
+             "interval in milliseconds between clock sync and latency measurements, 0 disables");
+DEFINE_string(sync_groups, "",
+              "groups of devices playing in sync, comma separated list of group=device1+device2");
+DEFINE_int32(sync_playout_delay, 250,
+             "delay in milliseconds between capture and playout on devices in sync groups");
+DEFINE_int32(idle_timeout, 30,
+             "seconds of silence after which the app is stopped and device disconnected, 0 keeps "
+             "them while the sink has inputs");
+DEFINE_bool(prewarm_connection, true,
+            "connect to device when its sink gets an input to launch the app faster on audio");
+DEFINE_int32(stop_app_timeout, 2000,
+             "milliseconds to wait for receiver to confirm stopping the app before disconnecting");
+DEFINE_string(standby, "none",
+              "what discovered devices keep ready without audio: none, connection or app");
+DEFINE_int32(reconnect_min_delay, 250,
+             "milliseconds before the first attempt to reconnect lost connection to device");
+DEFINE_int32(reconnect_max_delay, 30000,
+             "maximum milliseconds between attempts to reconnect, delay doubles after failures");
+DEFINE_int32(reconnect_max_failures, 10,
+             "failed reconnects in a row after which device is only tried every "
+             "--circuit_breaker_timeout");
+DEFINE_int32(circuit_breaker_timeout, 300,
+             "seconds between attempts to connect to device that failed too many times");
+DEFINE_int32(replay_buffer, 1000,
+             "milliseconds of audio captured while reconnecting replayed to receiver, 0 disables");
+DEFINE_int32(manager_shards, 0,
+             "number of shards devices are split between, 0 for one per CPU core");
 
-ChromecastsManager::ChromecastsManager(asio::io_service& io_service_, const char* logger_name)
-        : io_service(io_service_), chromecasts_strand(io_service),
-          sinks_manager(io_service, logger_name), finder(io_service, logger_name),
-          broadcaster(io_service, logger_name), error_handler(nullptr) {
+static std::size_t get_num_shards() {
+    if (FLAGS_manager_shards > 0) {
+        return static_cast<std::size_t>(FLAGS_manager_shards);
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+static const char* get_state_name(Chromecast::StreamState state) {
+    switch (state) {
+        case Chromecast::StreamState::IDLE: return "IDLE";
+        case Chromecast::StreamState::WARM: return "WARM";
+        case Chromecast::StreamState::STREAMING: return "STREAMING";
+    }
+    return "unknown";
+}
+
+static int64_t elapsed_ms(int64_t since) {
+    return (get_monotonic_time_us() - since) / 1000;
+}
+
+ChromecastsManager::ChromecastsManager(IoServicePool& io_service_pool, const char* logger_name)
+        : io_service(io_service_pool.get_io_service(IoServicePool::Role::CONTROL)),
+          shard_ring(get_num_shards()), groups_strand(io_service),
+          standby_state(Chromecast::StreamState::IDLE),
+          tls_context(std::make_shared<TlsClientContext>()),
+          sinks_manager(io_service_pool.get_io_service(IoServicePool::Role::CAPTURE), logger_name),
+          finder(io_service, logger_name),
+          broadcaster(io_service_pool.get_io_service(IoServicePool::Role::WEBSOCKET), logger_name),
+          error_handler(nullptr) {
     logger = spdlog::get(logger_name);
 
-    finder.set_update_handler(chromecasts_strand.wrap(
+    for (std::size_t i = 0; i < shard_ring.get_num_shards(); ++i) {
+        shards.emplace_back(std::make_unique<Shard>(io_service_pool.get_io_service_for(i)));
+    }
+
+    finder.set_update_handler(
             [this](ChromecastFinder::UpdateType type, ChromecastFinder::ChromecastInfo info) {
-                finder_callback(type, info);
-            }));
+                get_shard(info.name).strand.dispatch(
+                        [this, type, info] { finder_callback(type, info); });
+            });
 
     finder.set_error_handler([this](const std::string& message) {
         propagate_error("ChromecastFinder: " + message);
@@ -42,31 +105,134 @@ ChromecastsManager::ChromecastsManager(asio::io_service& io_service_, const char
     sinks_manager.set_error_handler(
             [&](const std::string& message) { propagate_error("AudioSinksManager: " + message); });
 
-    broadcaster.set_subscribe_handler(chromecasts_strand.wrap(
+    broadcaster.set_subscribe_handler(
             [this](WebsocketBroadcaster::MessageHandler handler, std::string name) {
-                websocket_subscribe_callback(handler, name);
-            }));
+                get_shard(name).strand.dispatch(
+                        [this, handler, name] { websocket_subscribe_callback(handler, name); });
+            });
+
+    broadcaster.set_stats_handler(
+            [this](WebsocketBroadcaster::StatsCallback callback) { stats_callback(callback); });
+
+    parse_sync_groups();
+    parse_standby();
+}
+
+void ChromecastsManager::parse_standby() {
+    if (FLAGS_standby == "connection") {
+        standby_state = Chromecast::StreamState::WARM;
+    } else if (FLAGS_standby == "app") {
+        standby_state = Chromecast::StreamState::STREAMING;
+    } else if (FLAGS_standby != "none") {
+        logger->warn("(ChromecastsManager) Unknown standby mode '{}', using 'none'",
+                     FLAGS_standby);
+    }
+}
+
+void ChromecastsManager::parse_sync_groups() {
+    std::stringstream list(FLAGS_sync_groups);
+    std::string entry;
+    while (std::getline(list, entry, ',')) {
+        if (entry.empty()) continue;
+        auto eq = entry.find('=');
+        std::vector<std::string> members;
+        if (eq != std::string::npos) {
+            std::stringstream members_list(entry.substr(eq + 1));
+            std::string member;
+            while (std::getline(members_list, member, '+')) {
+                if (!member.empty()) members.push_back(member);
+            }
+        }
+        if (eq == std::string::npos || eq == 0 || members.empty()) {
+            logger->warn("(ChromecastsManager) Invalid sync group '{}', ignoring", entry);
+            continue;
+        }
+        sync_groups[entry.substr(0, eq)] = members;
+    }
+}
+
+void ChromecastsManager::set_group_state(const std::string& group,
+                                         Chromecast::StreamState state) {
+    assert(groups_strand.running_in_this_thread());
+
+    group_states[group] = state;
+    const bool active = state != Chromecast::StreamState::IDLE;
+    for (const auto& member : sync_groups[group]) {
+        if (active) {
+            auto it = active_groups.find(member);
+            if (it != active_groups.end() && it->second != group) {
+                logger->warn("(ChromecastsManager) Device '{}' already plays group '{}'", member,
+                             it->second);
+                continue;
+            }
+            active_groups[member] = group;
+        } else {
+            auto it = active_groups.find(member);
+            if (it == active_groups.end() || it->second != group) continue;
+            active_groups.erase(it);
+        }
+        Shard& shard = get_shard(member);
+        shard.strand.dispatch([this, &shard, member, group, active, state] {
+            auto chromecast = shard.chromecasts.find(member);
+            if (chromecast != shard.chromecasts.end()) {
+                chromecast->second->set_group(active ? group : "", state);
+            } else {
+                logger->warn("(ChromecastsManager) Device '{}' of sync group '{}' is not known",
+                             member, group);
+            }
+        });
+    }
+}
+
+// Tells newly discovered device about the group it should play.
+void ChromecastsManager::apply_group(const std::string& name) {
+    assert(groups_strand.running_in_this_thread());
+
+    auto group = active_groups.find(name);
+    if (group == active_groups.end()) {
+        return;
+    }
+    Shard& shard = get_shard(name);
+    shard.strand.dispatch(
+            [&shard, name, group_name = group->second, state = group_states[group->second]] {
+                auto chromecast = shard.chromecasts.find(name);
+                if (chromecast != shard.chromecasts.end()) {
+                    chromecast->second->set_group(group_name, state);
+                }
+            });
 }
 
 void ChromecastsManager::finder_callback(ChromecastFinder::UpdateType type,
                                          ChromecastFinder::ChromecastInfo info) {
-    assert(chromecasts_strand.running_in_this_thread());
+    Shard& shard = get_shard(info.name);
+    assert(shard.strand.running_in_this_thread());
+    auto& chromecasts = shard.chromecasts;
 
     switch (type) {
         case ChromecastFinder::UpdateType::NEW: {
+            if (sync_groups.count(info.name) > 0) {
+                logger->error("(ChromecastsManager) Chromecast '{}' has name of a sync group",
+                              info.name);
+                break;
+            }
             logger->info("(ChromecastsManager) New Chromecast '{}'", info.name);
             auto chromecast = Chromecast::create(*this, info);
             chromecast->start();
             chromecasts[info.name] = chromecast;
+            std::string name = info.name;
+            groups_strand.dispatch([this, name] { apply_group(name); });
             break;
         }
         case ChromecastFinder::UpdateType::UPDATE: {
-            chromecasts[info.name]->update_info(info);
+            auto it = chromecasts.find(info.name);
+            if (it != chromecasts.end() && !it->second->is_group()) {
+                it->second->update_info(info);
+            }
             break;
         }
         case ChromecastFinder::UpdateType::REMOVE: {
             auto it = chromecasts.find(info.name);
-            if (it != chromecasts.end()) {
+            if (it != chromecasts.end() && !it->second->is_group()) {
                 it->second->stop();
                 chromecasts.erase(it);
                 logger->info("(ChromecastsManager) Chromecast '{}' removed", info.name);
@@ -84,20 +250,82 @@ void ChromecastsManager::finder_callback(ChromecastFinder::UpdateType type,
 
 void ChromecastsManager::websocket_subscribe_callback(WebsocketBroadcaster::MessageHandler handler,
                                                       std::string name) {
-    assert(chromecasts_strand.running_in_this_thread());
+    Shard& shard = get_shard(name);
+    assert(shard.strand.running_in_this_thread());
 
-    auto it = chromecasts.find(name);
-    if (it != chromecasts.end()) {
-        it->second->set_message_handler(handler);
+    auto it = shard.chromecasts.find(name);
+    if (it != shard.chromecasts.end()) {
+        it->second->add_subscriber(handler);
     } else {
         logger->warn("(ChromecastsManager) Chromecast '{}' subscribed but is not known in manager",
                      name);
     }
 }
 
+// Devices are collected on strands of their shards, the last shard sends the response. Shard
+// strands are not the devices' strands, so only thread safe Chromecast::get_stats is used.
+void ChromecastsManager::stats_callback(WebsocketBroadcaster::StatsCallback callback) {
+    struct Collector {
+        std::mutex mu;
+        nlohmann::json devices = nlohmann::json::array();
+        std::vector<std::size_t> shard_sizes;
+        std::size_t remaining;
+    };
+    auto collector = std::make_shared<Collector>();
+    collector->shard_sizes.resize(shards.size());
+    collector->remaining = shards.size();
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+        Shard& shard = *shards[i];
+        shard.strand.dispatch([this, &shard, i, collector, callback] {
+            nlohmann::json devices = nlohmann::json::array();
+            for (auto& chromecast : shard.chromecasts) {
+                devices.push_back(chromecast.second->get_stats());
+            }
+            std::unique_lock<std::mutex> lock(collector->mu);
+            for (auto& device : devices) {
+                collector->devices.push_back(std::move(device));
+            }
+            collector->shard_sizes[i] = shard.chromecasts.size();
+            if (--collector->remaining == 0) {
+                lock.unlock();
+                send_stats(std::move(collector->devices), std::move(collector->shard_sizes),
+                           callback);
+            }
+        });
+    }
+}
+
+void ChromecastsManager::send_stats(nlohmann::json devices, std::vector<std::size_t> shard_sizes,
+                                    WebsocketBroadcaster::StatsCallback callback) {
+    auto pool_stats = sinks_manager.get_frame_pool_stats();
+    auto tls_stats = tls_context->get_stats();
+    callback({{"devices", devices},
+              {"shards", shard_sizes},
+              {"framePool",
+               {{"frames", pool_stats.frames},
+                {"inUse", pool_stats.in_use},
+                {"peakInUse", pool_stats.peak_in_use},
+                {"exhausted", pool_stats.exhausted}}},
+              {"tls",
+               {{"fullHandshakes", tls_stats.full_handshakes},
+                {"resumedHandshakes", tls_stats.resumed_handshakes},
+                {"fullHandshakeTime", tls_stats.full_handshake_time},
+                {"resumedHandshakeTime", tls_stats.resumed_handshake_time},
+                {"cachedSessions", tls_stats.cached_sessions}}}});
+}
+
 void ChromecastsManager::start() {
     broadcaster.start();
     sinks_manager.start();
+    for (const auto& group : sync_groups) {
+        Shard& shard = get_shard(group.first);
+        shard.strand.dispatch([this, &shard, &group] {
+            logger->info("(ChromecastsManager) New sync group '{}'", group.first);
+            auto chromecast = Chromecast::create_group(*this, group.first, group.second);
+            chromecast->start();
+            shard.chromecasts[group.first] = chromecast;
+        });
+    }
     finder.start();
 }
 
@@ -116,8 +344,20 @@ void ChromecastsManager::propagate_error(const std::string& message) {
 }
 
 Chromecast::Chromecast(ChromecastsManager& manager_, ChromecastFinder::ChromecastInfo info_,
-                       private_tag)
-        : manager(manager_), info(info_), strand(manager.io_service), activated(false) {}
+                       std::vector<std::string> members_, private_tag)
+        : manager(manager_), io_service(manager.get_shard(info_.name).io_service), info(info_),
+          members(members_), strand(io_service), sender_strand(io_service),
+          samples_ring(static_cast<std::size_t>(FLAGS_samples_ring_size)), drain_scheduled(false),
+          samples_ring_overruns(0), samples_ring_overrun(false), samples_audible(false),
+          broadcast_group(manager.sinks_manager.get_frame_pool()),
+          capture_format(manager.sinks_manager.get_sink_format()), activated(false),
+          audible(false), stream_state(StreamState::IDLE), idle_timer(io_service),
+          group_state(StreamState::IDLE), app_launched(false), stop_app_pending(false),
+          stop_app_timer(io_service), connect_start_time(0), launch_start_time(0),
+          stream_start_time(0), audio_start_time(0), connection_id(0),
+          reconnect_timer(io_service), reconnect_pending(false), reconnect_failures(0),
+          random_engine(std::random_device()()), clock_sync_timer(io_service),
+          request_stats(std::make_shared<RequestStats>()), stats_name(info_.name) {}
 
 void Chromecast::start() {
     std::string* pretty_name = &info.name;
@@ -127,22 +367,68 @@ void Chromecast::start() {
     }
     sink = manager.sinks_manager.create_new_sink(info.name, *pretty_name);
 
-    sink->set_activation_callback(mem_weak_wrap(&Chromecast::activation_callback));
-    sink->set_volume_callback(mem_weak_wrap(&Chromecast::volume_callback));
-
-    sink->set_samples_callback(wrap_weak_ptr(
-            [this](const AudioSample* s, size_t n) {
-                std::lock_guard<std::mutex> guard(message_handler_mu);
-                WebsocketBroadcaster::send_samples(message_handler, s, n);
+    auto activation = mem_weak_wrap(&Chromecast::activation_callback);
+    sink->set_activation_callback(wrap_weak_ptr(
+            [this, activation](bool activate) mutable {
+                // Called on PulseAudio strand, so samples after activation start from silence.
+                samples_audible = false;
+                activation(activate);
             },
             this));
+    sink->set_volume_callback(mem_weak_wrap(&Chromecast::volume_callback));
+
+    sink->set_samples_callback(
+            wrap_weak_ptr([this](AudioFrameRef frame) { push_samples(std::move(frame)); }, this));
+
+    strand.dispatch(weak_wrap([this] { set_stream_state(get_rest_state()); }));
+}
+
+void Chromecast::push_samples(AudioFrameRef frame) {
+    // Only changes of activity are passed to strand, not every frame.
+    if (frame->silent() == samples_audible) {
+        samples_audible = !frame->silent();
+        mem_weak_wrap(&Chromecast::audio_activity_callback)(samples_audible);
+    }
+    if (!samples_ring.push(std::move(frame))) {
+        samples_ring_overruns.fetch_add(1, std::memory_order_relaxed);
+        if (!samples_ring_overrun) {
+            samples_ring_overrun = true;
+            manager.logger->warn("(Chromecast '{}') Samples ring overrun, sender can't keep up",
+                                 info.name);
+        }
+    } else {
+        samples_ring_overrun = false;
+    }
+    if (!drain_scheduled.exchange(true)) {
+        sender_strand.post(wrap_weak_ptr([this] { drain_samples(); }, this));
+    }
+}
+
+void Chromecast::drain_samples() {
+    assert(sender_strand.running_in_this_thread());
+    AudioFrameRef frame;
+    do {
+        while (samples_ring.pop(frame)) {
+            broadcast_group.broadcast(std::move(frame));
+        }
+        drain_scheduled.store(false);
+        // Producer might have pushed after last pop but before we cleared the flag.
+    } while (!samples_ring.empty() && !drain_scheduled.exchange(true));
 }
 
 void Chromecast::stop() {
+    idle_timer.cancel();
+    reconnect_timer.cancel();
+    stop_app_timer.cancel();
+    clock_sync_timer.cancel();
     if (connection) {
         connection->stop();
         connection.reset();
     }
+    {
+        std::lock_guard<std::mutex> guard(stats_mutex);
+        stats_connection.reset();
+    }
     if (main_channel) {
         main_channel.reset();
     }
@@ -153,16 +439,68 @@ void Chromecast::stop() {
 
 std::shared_ptr<Chromecast> Chromecast::create(ChromecastsManager& manager_,
                                                ChromecastFinder::ChromecastInfo info_) {
-    return std::make_shared<Chromecast>(manager_, info_, private_tag{});
+    return std::make_shared<Chromecast>(manager_, info_, std::vector<std::string>(),
+                                        private_tag{});
+}
+
+std::shared_ptr<Chromecast> Chromecast::create_group(ChromecastsManager& manager_,
+                                                     std::string name,
+                                                     std::vector<std::string> members_) {
+    ChromecastFinder::ChromecastInfo info;
+    info.name = name;
+    return std::make_shared<Chromecast>(manager_, info, members_, private_tag{});
 }
 
 void Chromecast::update_info(ChromecastFinder::ChromecastInfo info_) {
-    strand.dispatch(weak_wrap([=] { info = info_; }));
+    strand.dispatch(weak_wrap([=] {
+        bool moved = info.endpoints != info_.endpoints;
+        info = info_;
+        {
+            std::lock_guard<std::mutex> guard(stats_mutex);
+            stats_name = info.name;
+        }
+        if (moved && reconnect_pending) {
+            // Device is back at a new address, no point in waiting for the next attempt.
+            manager.logger->info("(Chromecast '{}') Announced new address, reconnecting",
+                                 info.name);
+            reconnect_failures = 0;
+            reconnect_timer.expires_from_now(std::chrono::milliseconds(0));
+            reconnect_timer.async_wait(mem_weak_wrap(&Chromecast::reconnect_timer_callback));
+        }
+    }));
 }
 
-void Chromecast::set_message_handler(WebsocketBroadcaster::MessageHandler handler) {
-    std::lock_guard<std::mutex> guard(message_handler_mu);
-    message_handler = handler;
+void Chromecast::add_subscriber(WebsocketBroadcaster::MessageHandler handler) {
+    sender_strand.dispatch(wrap_weak_ptr(
+            [this, handler]() mutable {
+                if (handler.format.rate == 0) {
+                    handler.format.rate = manager.sinks_manager.get_sink_format().rate;
+                }
+                // First subscriber decides in which format PulseAudio captures samples, others
+                // get theirs converted if needed.
+                if (handler.format != capture_format &&
+                    broadcast_group.get_num_subscribers() == 0) {
+                    capture_format = handler.format;
+                    sink->set_format(capture_format);
+                }
+                try {
+                    broadcast_group.add_subscriber(handler, capture_format);
+                } catch (const AudioEncoderException& e) {
+                    manager.logger->error("(Chromecast '{}') {}", info.name, e.what());
+                    return;
+                } catch (const ResamplerException& e) {
+                    manager.logger->error("(Chromecast '{}') {}", info.name, e.what());
+                    return;
+                }
+                if (!WebsocketBroadcaster::send_subscribed(handler)) {
+                    return;
+                }
+                broadcast_group.flush_replay();
+                manager.logger->debug("(Chromecast '{}') Has now {} subscribers using {} encodings",
+                                      info.name, broadcast_group.get_num_subscribers(),
+                                      broadcast_group.get_num_encodings());
+            },
+            this));
 }
 
 void Chromecast::volume_callback(double left, double right, bool muted) {
@@ -176,95 +514,505 @@ void Chromecast::volume_callback(double left, double right, bool muted) {
 
 void Chromecast::activation_callback(bool activate) {
     activated = activate;
+    manager.logger->info("(Chromecast '{}') {}", info.name,
+                         activated ? "Activated!" : "Deactivated!");
     if (activated) {
-        manager.logger->info("(Chromecast '{}') Activated!", info.name);
-        connection = ChromecastConnection::create(manager.io_service, *info.endpoints.begin());
-        connection->set_error_handler(mem_weak_wrap(&Chromecast::connection_error_handler));
-        connection->set_connected_handler(mem_weak_wrap(&Chromecast::connection_connected_handler));
-        connection->set_messages_handler(mem_weak_wrap(&Chromecast::connection_message_handler));
-        connection->start();
+        if (stream_state == StreamState::IDLE && FLAGS_prewarm_connection) {
+            set_stream_state(StreamState::WARM);
+            start_idle_timer();
+        }
     } else {
-        manager.logger->info("(Chromecast '{}') Deactivated!", info.name);
-        connection->stop();
-        connection.reset();
-        main_channel.reset();
-        app_channel.reset();
+        audible = false;
+        if (stream_state == StreamState::WARM) {
+            idle_timer.cancel();
+            set_stream_state(get_rest_state());
+        } else if (stream_state == StreamState::STREAMING) {
+            start_idle_timer();
+        }
     }
 }
 
-void Chromecast::connection_error_handler(std::string message) {
-    manager.logger->error("(Chromecast '{}') connection error: {}", info.name, message);
-    connection.reset();
-    main_channel.reset();
+void Chromecast::audio_activity_callback(bool audible_) {
+    audible = audible_;
+    manager.logger->debug("(Chromecast '{}') Captured {}", info.name,
+                          audible ? "audio" : "silence");
+    if (audible) {
+        idle_timer.cancel();
+        if (stream_state != StreamState::STREAMING) {
+            audio_start_time = get_monotonic_time_us();
+        }
+        set_stream_state(StreamState::STREAMING);
+    } else if (stream_state != get_rest_state()) {
+        start_idle_timer();
+    }
+}
+
+// State of the sink device streams, its group's one when it's used by a sync group.
+Chromecast::StreamState Chromecast::get_target_state() const {
+    return group.empty() ? stream_state : group_state;
+}
+
+// State devices go back to when there is no audio.
+Chromecast::StreamState Chromecast::get_rest_state() const {
+    // Members of a group in standby would stream the group instead of their own sinks.
+    return is_group() ? StreamState::IDLE : manager.standby_state;
+}
+
+void Chromecast::set_stream_state(StreamState state) {
+    if (state == stream_state) {
+        return;
+    }
+    manager.logger->info("(Chromecast '{}') State {} -> {}", info.name,
+                         get_state_name(stream_state), get_state_name(state));
+    stream_state = state;
+    if (state != StreamState::STREAMING) {
+        audio_start_time = 0;
+    }
+    if (is_group()) {
+        std::string name = info.name;
+        manager.groups_strand.dispatch(
+                [this, name, state] { manager.set_group_state(name, state); });
+    } else {
+        update_connection();
+    }
+}
+
+void Chromecast::start_idle_timer() {
+    if (FLAGS_idle_timeout <= 0) {
+        // Without grace period device streams exactly as long as the sink has inputs.
+        if (!activated) {
+            set_stream_state(get_rest_state());
+        }
+        return;
+    }
+    idle_timer.expires_from_now(std::chrono::seconds(FLAGS_idle_timeout));
+    idle_timer.async_wait(mem_weak_wrap(&Chromecast::idle_timer_callback));
+}
+
+void Chromecast::idle_timer_callback(const asio::error_code& error) {
+    // Audio might have started after the timer expired but before this callback.
+    if (error == asio::error::operation_aborted || audible ||
+        stream_state == get_rest_state()) {
+        return;
+    }
+    manager.logger->info("(Chromecast '{}') Idle for {}s", info.name, FLAGS_idle_timeout);
+    set_stream_state(get_rest_state());
+}
+
+void Chromecast::set_group(std::string group_, StreamState group_state_) {
+    strand.dispatch(weak_wrap([this, group_, group_state_] {
+        group = group_;
+        group_state = group_state_;
+        update_connection();
+    }));
+}
+
+// Connects to device in every state but IDLE and streams the sink of its group or its own sink
+// when STREAMING.
+void Chromecast::update_connection() {
+    if (stop_app_pending) {
+        // finish_stop_app calls us again when the app is stopped.
+        return;
+    }
+    StreamState state = get_target_state();
+    std::string name = state == StreamState::IDLE ? "" : !group.empty() ? group : info.name;
+    if (state != StreamState::STREAMING && app_launched && main_channel && !session_id.empty()) {
+        stop_app();
+        return;
+    }
+    if (state == StreamState::IDLE) {
+        if (connection) {
+            connection->stop();
+            reset_session();
+        }
+        set_replay(false);
+        stream_name.clear();
+        return;
+    }
+    if (name != stream_name && app_channel) {
+        // Launched app only switches to the other sink.
+        manager.logger->info("(Chromecast '{}') Switching from stream '{}' to '{}'", info.name,
+                             stream_name, name);
+        stream_name = name;
+        app_channel->stop_stream([](AppChromecastChannel::Result) {});
+        start_stream();
+        return;
+    }
+    stream_name = name;
+    if (connection) {
+        if (state == StreamState::STREAMING) {
+            launch_app();
+        }
+        return;
+    }
+    if (reconnect_pending) {
+        // reconnect_timer_callback calls us again.
+        return;
+    }
+    manager.logger->info("(Chromecast '{}') Connecting to stream '{}'", info.name, stream_name);
+    connect_start_time = get_monotonic_time_us();
+    const uint64_t id = ++connection_id;
+    connection = ChromecastConnection::create(io_service, strand, manager.tls_context,
+                                              *info.endpoints.begin());
+    connection->set_error_handler(weak_wrap(
+            [this, id](std::string message) { connection_error_handler(id, message); }));
+    connection->set_connected_handler(
+            weak_wrap([this, id](bool connected) { connection_connected_handler(id, connected); }));
+    connection->set_messages_handler(wrap_weak_ptr(
+            [this, id](const cast_channel::CastMessage& message) {
+                connection_message_handler(id, message);
+            },
+            this));
+    connection->start();
+    std::lock_guard<std::mutex> guard(stats_mutex);
+    stats_connection = connection;
+}
+
+void Chromecast::launch_app() {
+    if (!main_channel || app_launched) {
+        return;
+    }
+    manager.logger->info("(Chromecast '{}') Launching app to stream '{}'", info.name, stream_name);
+    app_launched = true;
+    launch_start_time = get_monotonic_time_us();
+    main_channel->load_app(FLAGS_chromecast_app_id, mem_weak_wrap(&Chromecast::handle_app_load));
+}
+
+// Stops the app so device goes back to its idle screen.
+void Chromecast::stop_app() {
+    manager.logger->info("(Chromecast '{}') Stopping app streaming '{}'", info.name, stream_name);
+    stop_app_pending = true;
+    clock_sync_timer.cancel();
+    main_channel->stop_app(session_id, weak_wrap([this](nlohmann::json) { finish_stop_app(); }));
+    stop_app_timer.expires_from_now(std::chrono::milliseconds(FLAGS_stop_app_timeout));
+    stop_app_timer.async_wait(weak_wrap([this](const asio::error_code& error) {
+        if (error != asio::error::operation_aborted && stop_app_pending) {
+            manager.logger->warn("(Chromecast '{}') Receiver didn't confirm stopping the app",
+                                 info.name);
+            finish_stop_app();
+        }
+    }));
+}
+
+void Chromecast::finish_stop_app() {
+    if (!stop_app_pending) {
+        return;
+    }
+    stop_app_pending = false;
+    stop_app_timer.cancel();
     app_channel.reset();
-    // TODO: try to reconnect after some time
+    transport_id.clear();
+    session_id.clear();
+    app_launched = false;
+    update_connection();
 }
 
-void Chromecast::connection_connected_handler(bool connected) {
+void Chromecast::connection_error_handler(uint64_t id, std::string message) {
+    if (id != connection_id) {
+        return;
+    }
+    manager.logger->error("(Chromecast '{}') connection error: {}", info.name, message);
+    connection_lost();
+}
+
+void Chromecast::connection_connected_handler(uint64_t id, bool connected) {
+    if (id != connection_id) {
+        return;
+    }
     if (connected) {
-        manager.logger->info("(Chromecast '{}') I'm connected!", info.name);
+        manager.logger->info("(Chromecast '{}') I'm connected in {}ms!", info.name,
+                             elapsed_ms(connect_start_time));
         main_channel =
-                MainChromecastChannel::create(manager.io_service, "sender-0", "receiver-0",
-                                              mem_weak_wrap(&Chromecast::connection_message_sender),
+                MainChromecastChannel::create(io_service, strand, "sender-0", "receiver-0",
+                                              message_sender(), request_stats,
                                               manager.logger->name().c_str());
+        main_channel->set_dead_handler(weak_wrap([this, id] { receiver_dead(id); }));
 
         main_channel->start();
 
-        main_channel->load_app(FLAGS_chromecast_app_id,
-                               mem_weak_wrap(&Chromecast::handle_app_load));
+        // Warm connection only waits for audio to launch the app.
+        if (get_target_state() == StreamState::STREAMING) {
+            launch_app();
+        } else {
+            reconnect_failures = 0;
+        }
     } else {
         manager.logger->info("(Chromecast '{}') I'm not connected!", info.name);
-        // TODO: add support for graceful app unloading
-        connection.reset();
-        main_channel.reset();
-        app_channel.reset();
-        // TODO: try to reconnect
+        connection_lost();
+    }
+}
+
+// Connection closed without us asking for it.
+void Chromecast::connection_lost() {
+    bool streaming = app_channel != nullptr;
+    reset_session();
+    if (get_target_state() == StreamState::IDLE) {
+        return;
+    }
+    if (streaming) {
+        set_replay(true);
+    }
+    schedule_reconnect();
+}
+
+// Receiver stopped answering heartbeats, TLS shutdown would wait for it forever.
+void Chromecast::receiver_dead(uint64_t id) {
+    if (id != connection_id) {
+        return;
     }
+    manager.logger->error("(Chromecast '{}') Receiver stopped responding", info.name);
+    connection->abort();
+    connection_lost();
+}
+
+void Chromecast::schedule_reconnect() {
+    ++reconnect_failures;
+    std::chrono::milliseconds delay;
+    if (reconnect_failures > FLAGS_reconnect_max_failures) {
+        // Circuit breaker is open, single attempt every timeout closes it when it succeeds.
+        delay = std::chrono::seconds(FLAGS_circuit_breaker_timeout);
+        set_replay(false);
+        manager.logger->warn("(Chromecast '{}') Failed to connect {} times, next try in {}s",
+                             info.name, reconnect_failures, FLAGS_circuit_breaker_timeout);
+    } else {
+        int64_t max_delay = std::max(FLAGS_reconnect_max_delay, FLAGS_reconnect_min_delay);
+        int64_t base = std::min<int64_t>(
+                max_delay, static_cast<int64_t>(FLAGS_reconnect_min_delay)
+                                   << std::min(reconnect_failures - 1, 20));
+        // Jitter spreads reconnects of all devices after the network comes back.
+        std::uniform_int_distribution<int64_t> jitter(base / 2, base);
+        delay = std::chrono::milliseconds(jitter(random_engine));
+        manager.logger->info("(Chromecast '{}') Reconnecting in {}ms", info.name, delay.count());
+    }
+    reconnect_pending = true;
+    reconnect_timer.expires_from_now(delay);
+    reconnect_timer.async_wait(mem_weak_wrap(&Chromecast::reconnect_timer_callback));
+}
+
+void Chromecast::reconnect_timer_callback(const asio::error_code& error) {
+    if (error == asio::error::operation_aborted) {
+        return;
+    }
+    reconnect_pending = false;
+    update_connection();
+}
+
+void Chromecast::set_replay(bool enabled) {
+    int64_t duration = enabled ? static_cast<int64_t>(FLAGS_replay_buffer) * 1000 : 0;
+    sender_strand.dispatch(wrap_weak_ptr(
+            [this, duration] { broadcast_group.set_replay_duration(duration); }, this));
 }
 
 void Chromecast::handle_app_load(nlohmann::json msg) try {
-    if (msg["type"] == "LAUNCH_ERROR") {
-        manager.logger->error("Failed to launch app");
+    if (msg["type"] == "TIMEOUT") {
+        // Receiver stopped talking to us, only a new connection can tell whether it's still there.
+        manager.logger->error("(Chromecast '{}') Receiver didn't respond to app launch", info.name);
+        connection_lost();
+    } else if (msg["type"] == "LAUNCH_ERROR") {
+        manager.logger->error("(Chromecast '{}') Failed to launch app", info.name);
+        app_launched = false;
     } else if (msg["type"] == "RECEIVER_STATUS") {
         transport_id = msg["status"]["applications"][0]["transportId"];
         session_id = msg["status"]["applications"][0]["sessionId"];
+        manager.logger->info("(Chromecast '{}') App launched in {}ms", info.name,
+                             elapsed_ms(launch_start_time));
 
         app_channel =
-                AppChromecastChannel::create(manager.io_service, "app-controller-0", transport_id,
-                                             mem_weak_wrap(&Chromecast::connection_message_sender),
+                AppChromecastChannel::create(io_service, strand, "app-controller-0", transport_id,
+                                             message_sender(), request_stats,
                                              manager.logger->name().c_str());
 
         app_channel->start();
-
-        auto addresses = get_local_addresses();
-        std::vector<asio::ip::tcp::endpoint> endpoints;
-        for (auto addr : addresses) {
-            endpoints.emplace_back(addr, manager.broadcaster.get_port());
+        if (get_target_state() == StreamState::STREAMING) {
+            start_stream();
+        } else {
+            // Audio stopped while the app was launching.
+            update_connection();
         }
-
-        app_channel->start_stream(endpoints.begin(), endpoints.end(), info.name,
-                                  mem_weak_wrap(&Chromecast::handle_stream_start));
     }
 } catch (std::domain_error) {
     manager.logger->error("(Chromecast '{}') JSON load app didn't have expected fields", info.name);
 }
 
+void Chromecast::start_stream() {
+    auto addresses = get_local_addresses();
+    std::vector<asio::ip::tcp::endpoint> endpoints;
+    for (auto addr : addresses) {
+        endpoints.emplace_back(addr, manager.broadcaster.get_port());
+    }
+
+    stream_start_time = get_monotonic_time_us();
+    app_channel->start_stream(endpoints.begin(), endpoints.end(), stream_name,
+                              mem_weak_wrap(&Chromecast::handle_stream_start));
+}
+
 void Chromecast::handle_stream_start(AppChromecastChannel::Result result) {
-    if (result.ok) {
-        manager.logger->info("(Chromecast '{}') Receiver started streaming!", info.name);
+    if (result.timeout) {
+        manager.logger->error("(Chromecast '{}') Receiver didn't respond to stream start",
+                              info.name);
+        connection_lost();
+        return;
+    }
+    // After reconnect receiver might still be streaming over websocket that survived.
+    if (result.ok || result.message == "Already streaming") {
+        manager.logger->info("(Chromecast '{}') Receiver started streaming in {}ms!", info.name,
+                             elapsed_ms(stream_start_time));
+        reconnect_failures = 0;
+        if (!result.ok) {
+            set_replay(false);
+        }
+        if (audio_start_time != 0) {
+            manager.logger->info("(Chromecast '{}') Streaming {}ms after the first audio",
+                                 info.name, elapsed_ms(audio_start_time));
+            audio_start_time = 0;
+        }
+        if (FLAGS_clock_sync_interval > 0) {
+            // Sync group members can't play in sync before the first clock sync.
+            clock_sync_timer_callback(asio::error_code());
+        }
     } else {
         manager.logger->error("(Chromecast '{}') Receiver failed to start streaming: {}", info.name,
                               result.message);
     }
 }
 
-void Chromecast::connection_message_sender(cast_channel::CastMessage message) {
+void Chromecast::reset_session() {
+    ++connection_id;
+    connection.reset();
+    main_channel.reset();
+    app_channel.reset();
+    transport_id.clear();
+    session_id.clear();
+    app_launched = false;
+    stop_app_pending = false;
+    clock_sync_timer.cancel();
+    clock_sync.reset();
+    std::lock_guard<std::mutex> guard(stats_mutex);
+    latency_stats = nullptr;
+    stats_connection.reset();
+}
+
+void Chromecast::start_clock_sync() {
+    if (FLAGS_clock_sync_interval <= 0) {
+        return;
+    }
+    clock_sync_timer.expires_from_now(std::chrono::milliseconds(FLAGS_clock_sync_interval));
+    clock_sync_timer.async_wait(mem_weak_wrap(&Chromecast::clock_sync_timer_callback));
+}
+
+void Chromecast::clock_sync_timer_callback(const asio::error_code& error) {
+    if (error == asio::error::operation_aborted || !app_channel) {
+        return;
+    }
+    app_channel->ping(mem_weak_wrap(&Chromecast::handle_pong));
+    start_clock_sync();
+}
+
+/*
+ * Receiver reports transit time of frames as difference between its arrival clock and sender
+ * capture timestamps, so removing clock offset leaves one way latency from capture to arrival.
+ * Adding time samples spend in receiver buffer and audio output gives end to end latency.
+ */
+void Chromecast::handle_pong(nlohmann::json pong, int64_t t0, int64_t t3) try {
+    clock_sync.add_sample(t0, pong["t1"].get<int64_t>(), pong["t2"].get<int64_t>(), t3);
+    if (stream_name != info.name && app_channel) {
+        app_channel->set_sync(clock_sync.get_offset(),
+                              static_cast<int64_t>(FLAGS_sync_playout_delay) * 1000,
+                              weak_wrap([this](AppChromecastChannel::Result result) {
+                                  if (!result.ok) {
+                                      manager.logger->warn(
+                                              "(Chromecast '{}') Receiver failed to sync: {}",
+                                              info.name, result.message);
+                                  }
+                              }));
+    }
+    const auto& stats = pong["stats"];
+    if (stats.is_null() || stats["frames"].get<int64_t>() == 0) {
+        return;
+    }
+    int64_t offset = clock_sync.get_offset();
+    int64_t one_way = stats["transitMean"].get<int64_t>() - offset;
+    int64_t playout = stats["bufferDelay"].get<int64_t>();
+    if (stream_name != info.name && one_way > FLAGS_sync_playout_delay * 1000) {
+        manager.logger->warn("(Chromecast '{}') One way latency {}ms exceeds sync playout delay",
+                             info.name, one_way / 1000);
+    }
+    nlohmann::json result = {{"stream", stream_name},
+                             {"clockOffset", offset},
+                             {"rtt", clock_sync.get_rtt()},
+                             {"oneWayLatency", one_way},
+                             {"oneWayLatencyMin", stats["transitMin"].get<int64_t>() - offset},
+                             {"oneWayLatencyMax", stats["transitMax"].get<int64_t>() - offset},
+                             {"playoutDelay", playout},
+                             {"endToEndLatency", one_way + playout},
+                             {"jitter", stats["jitter"]},
+                             {"lostFrames", stats["lostFrames"]},
+                             {"frames", stats["frames"]},
+                             {"drift", stats.value("drift", 0.0)}};
+    manager.logger->debug(
+            "(Chromecast '{}') latency: one way {}us, playout {}us, end to end {}us, jitter {}us, "
+            "rtt {}us, drift {:.1f}ppm",
+            info.name, one_way, playout, one_way + playout, stats["jitter"].get<int64_t>(),
+            clock_sync.get_rtt(), stats.value("drift", 0.0));
+    std::lock_guard<std::mutex> guard(stats_mutex);
+    result["name"] = stats_name;
+    latency_stats = result;
+} catch (std::domain_error) {
+    manager.logger->warn("(Chromecast '{}') PONG didn't have expected fields", info.name);
+}
+
+nlohmann::json Chromecast::get_stats() const {
+    nlohmann::json stats;
+    std::shared_ptr<ChromecastConnection> conn;
+    {
+        std::lock_guard<std::mutex> guard(stats_mutex);
+        stats = latency_stats;
+        conn = stats_connection;
+        if (stats.is_null()) {
+            stats = {{"name", stats_name}};
+        }
+    }
+    stats["samplesRingOverruns"] = get_samples_ring_overruns();
+    if (conn) {
+        auto conn_stats = conn->get_stats();
+        stats["connection"] = {{"messagesSent", conn_stats.messages_sent},
+                               {"bytesSent", conn_stats.bytes_sent},
+                               {"batchesSent", conn_stats.batches_sent}};
+    }
+    nlohmann::json requests = nlohmann::json::object();
+    for (const auto& entry : request_stats->get_histograms()) {
+        const auto& histogram = entry.second;
+        int64_t mean_latency =
+                histogram.count == 0 ? 0 : histogram.total_latency /
+                                                   static_cast<int64_t>(histogram.count);
+        nlohmann::json buckets = nlohmann::json::object();
+        for (std::size_t i = 0; i < histogram.buckets.size(); ++i) {
+            buckets[i < RequestStats::bucket_bounds_ms.size()
+                            ? std::to_string(RequestStats::bucket_bounds_ms[i])
+                            : "inf"] = histogram.buckets[i];
+        }
+        requests[entry.first] = {
+                {"count", histogram.count},
+                {"retries", histogram.retries},
+                {"timeouts", histogram.timeouts},
+                {"meanLatency", mean_latency},
+                {"latencyHistogramMs", buckets}};
+    }
+    stats["requests"] = requests;
+    return stats;
+}
+
+void Chromecast::connection_message_sender(const cast_channel::CastMessage& message) {
     if (connection) {
         connection->send_message(message);
     }
 }
 
-void Chromecast::connection_message_handler(cast_channel::CastMessage message) {
+void Chromecast::connection_message_handler(uint64_t id,
+                                            const cast_channel::CastMessage& message) {
+    if (id != connection_id) {
+        return;
+    }
     if (main_channel &&
         (message.destination_id() == "sender-0" || message.destination_id() == "*")) {
         main_channel->dispatch_message(message);
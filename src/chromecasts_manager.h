@@ -17,16 +17,27 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <unordered_map>
+#include <vector>
 
 #include <asio/io_service.hpp>
+#include <asio/steady_timer.hpp>
 #include <asio/strand.hpp>
 
 #include "audio_sinks_manager.h"
+#include "broadcast_group.h"
 #include "chromecast_channel.h"
 #include "chromecast_connection.h"
 #include "chromecast_finder.h"
+#include "clock_sync.h"
+#include "consistent_hash_ring.h"
+#include "io_service_pool.h"
+#include "spsc_ring.h"
+#include "tls_client_context.h"
 #include "websocket_broadcaster.h"
 
 class ChromecastsManagerException : public std::runtime_error {
@@ -36,25 +47,66 @@ class ChromecastsManagerException : public std::runtime_error {
 
 class ChromecastsManager;
 
+/*
+ * Chromecast is either a single device or a sync group of devices. Every one of them has its own
+ * sink, when sink of a sync group is activated its members stream the group's sink instead of
+ * their own and play samples at the same time using capture timestamps and clock offset.
+ *
+ * Connection follows audio activity of the sink rather than its inputs, many apps keep their
+ * sink input open while silent:
+ *  - IDLE: nothing is connected,
+ *  - WARM: sink got an input, device is connected but the app is not launched yet,
+ *  - STREAMING: sink captured audible samples, the app is launched and streams the sink.
+ * After --idle_timeout seconds of silence or without sink inputs it goes back to IDLE, or to
+ * the state kept for discovered devices in --standby mode.
+ *
+ * Lost connections are reconnected with jittered exponential backoff. After
+ * --reconnect_max_failures failures in a row the circuit breaker opens and device is only
+ * retried every --circuit_breaker_timeout seconds. Audio captured while reconnecting is kept
+ * and replayed to the receiver once it subscribes again.
+ */
 class Chromecast : public std::enable_shared_from_this<Chromecast> {
   private:
     struct private_tag {};
 
   public:
+    enum class StreamState { IDLE, WARM, STREAMING };
+
     Chromecast(const Chromecast&) = delete;
 
     void update_info(ChromecastFinder::ChromecastInfo info_);
 
-    void set_message_handler(WebsocketBroadcaster::MessageHandler handler);
+    void add_subscriber(WebsocketBroadcaster::MessageHandler handler);
+
+    // Makes the device stream sync group's sink in the group's state, empty group name goes back
+    // to its own sink.
+    void set_group(std::string group_, StreamState group_state_);
 
-    Chromecast(ChromecastsManager& manager_, ChromecastFinder::ChromecastInfo info_, private_tag);
+    Chromecast(ChromecastsManager& manager_, ChromecastFinder::ChromecastInfo info_,
+               std::vector<std::string> members_, private_tag);
 
     static std::shared_ptr<Chromecast> create(ChromecastsManager& manager_,
                                               ChromecastFinder::ChromecastInfo info_);
 
+    static std::shared_ptr<Chromecast> create_group(ChromecastsManager& manager_,
+                                                    std::string name,
+                                                    std::vector<std::string> members_);
+
+    bool is_group() const {
+        return !members.empty();
+    }
+
     void start();
     void stop();
 
+    uint64_t get_samples_ring_overruns() const {
+        return samples_ring_overruns.load(std::memory_order_relaxed);
+    }
+
+    // Latest latency measurements, safe to call from any thread. Reads only atomics and data
+    // guarded by stats_mutex, never state owned by the strand.
+    nlohmann::json get_stats() const;
+
   private:
     template <class F>
     auto weak_wrap(F&& f) {
@@ -66,26 +118,91 @@ class Chromecast : public std::enable_shared_from_this<Chromecast> {
         return weak_wrap([this, mem](Args... args) { (this->*mem)(args...); });
     }
 
+    // Connection and channels run on our strand, so messages between them aren't copied.
+    auto message_sender() {
+        return wrap_weak_ptr(
+                [this](const cast_channel::CastMessage& message) {
+                    connection_message_sender(message);
+                },
+                this);
+    }
+
     void volume_callback(double left, double right, bool muted);
     void activation_callback(bool activate);
-    void connection_error_handler(std::string message);
-    void connection_connected_handler(bool connected);
-    void connection_message_sender(cast_channel::CastMessage message);
-    void connection_message_handler(cast_channel::CastMessage message);
+    void audio_activity_callback(bool audible_);
+    void set_stream_state(StreamState state);
+    StreamState get_target_state() const;
+    StreamState get_rest_state() const;
+    void start_idle_timer();
+    void idle_timer_callback(const asio::error_code& error);
+    void update_connection();
+    void launch_app();
+    void start_stream();
+    void stop_app();
+    void finish_stop_app();
+    void connection_error_handler(uint64_t id, std::string message);
+    void connection_connected_handler(uint64_t id, bool connected);
+    void connection_lost();
+    void receiver_dead(uint64_t id);
+    void schedule_reconnect();
+    void reconnect_timer_callback(const asio::error_code& error);
+    void set_replay(bool enabled);
+    void connection_message_sender(const cast_channel::CastMessage& message);
+    void connection_message_handler(uint64_t id, const cast_channel::CastMessage& message);
     void handle_app_load(nlohmann::json);
     void handle_stream_start(AppChromecastChannel::Result result);
+    void start_clock_sync();
+    void clock_sync_timer_callback(const asio::error_code& error);
+    void handle_pong(nlohmann::json pong, int64_t t0, int64_t t3);
+    void reset_session();
+    void push_samples(AudioFrameRef frame);
+    void drain_samples();
 
     ChromecastsManager& manager;
+    asio::io_service& io_service;  // of the device's shard
     std::shared_ptr<AudioSink> sink;
     ChromecastFinder::ChromecastInfo info;
+    const std::vector<std::string> members;  // members of sync group, empty for devices
     std::shared_ptr<ChromecastConnection> connection;
     asio::io_service::strand strand;
-    std::mutex message_handler_mu;
-    WebsocketBroadcaster::MessageHandler message_handler;
+    // Samples are produced on PulseAudio strand and sent from sender_strand, so slow
+    // connection never blocks capture. broadcast_group is only accessed from sender_strand.
+    asio::io_service::strand sender_strand;
+    SpscRing<AudioFrameRef> samples_ring;
+    std::atomic<bool> drain_scheduled;
+    std::atomic<uint64_t> samples_ring_overruns;
+    bool samples_ring_overrun;  // only accessed from PulseAudio strand
+    bool samples_audible;       // only accessed from PulseAudio strand
+    BroadcastGroup broadcast_group;
+    AudioFormat capture_format;  // only accessed from sender_strand
     bool activated;
+    bool audible;  // whether the last captured samples weren't silent
+    StreamState stream_state;
+    asio::steady_timer idle_timer;
+    std::string group;  // sync group currently using this device
+    StreamState group_state;
+    std::string stream_name;  // name of the sink receiver streams, empty when not connected
+    bool app_launched;
+    bool stop_app_pending;  // connection is closed after receiver confirms stopping the app
+    asio::steady_timer stop_app_timer;
+    // Starts of connection phases in monotonic microseconds, 0 when not in progress.
+    int64_t connect_start_time, launch_start_time, stream_start_time, audio_start_time;
+    uint64_t connection_id;  // events of connections with older id are ignored
+    asio::steady_timer reconnect_timer;
+    bool reconnect_pending;  // no new connection until reconnect_timer expires
+    int reconnect_failures;  // in a row, circuit breaker is open when above the limit
+    std::minstd_rand random_engine;
     std::shared_ptr<MainChromecastChannel> main_channel;
     std::shared_ptr<AppChromecastChannel> app_channel;
     std::string transport_id, session_id;
+    asio::steady_timer clock_sync_timer;
+    ClockSync clock_sync;  // only accessed from strand
+    std::shared_ptr<RequestStats> request_stats;  // of all sessions, thread safe
+
+    mutable std::mutex stats_mutex;
+    std::string stats_name;  // copy of info.name, get_stats can't read info off the strand
+    nlohmann::json latency_stats;
+    std::shared_ptr<ChromecastConnection> stats_connection;  // current connection for stats
 };
 
 class ChromecastsManager {
@@ -94,7 +211,7 @@ class ChromecastsManager {
 
     ChromecastsManager(const ChromecastsManager&) = delete;
 
-    ChromecastsManager(asio::io_service& io_service_, const char* logger_name = "default");
+    ChromecastsManager(IoServicePool& io_service_pool, const char* logger_name = "default");
 
     void start();
     void stop();
@@ -106,12 +223,43 @@ class ChromecastsManager {
   private:
     void finder_callback(ChromecastFinder::UpdateType type, ChromecastFinder::ChromecastInfo info);
     void websocket_subscribe_callback(WebsocketBroadcaster::MessageHandler, std::string);
+    void stats_callback(WebsocketBroadcaster::StatsCallback callback);
+    void send_stats(nlohmann::json devices, std::vector<std::size_t> shard_sizes,
+                    WebsocketBroadcaster::StatsCallback callback);
+    void parse_sync_groups();
+    void parse_standby();
+    void set_group_state(const std::string& group, Chromecast::StreamState state);
+    void apply_group(const std::string& name);
     void propagate_error(const std::string& message);
 
+    /*
+     * Devices and sync groups are split between shards by consistent hash of their name, so
+     * discovery updates and subscriptions of different devices don't wait for each other.
+     */
+    struct Shard {
+        explicit Shard(asio::io_service& io_service_)
+                : io_service(io_service_), strand(io_service) {}
+
+        asio::io_service& io_service;  // of devices in the shard
+        asio::io_service::strand strand;
+        std::unordered_map<std::string, std::shared_ptr<Chromecast>> chromecasts;
+    };
+
+    Shard& get_shard(const std::string& name) {
+        return *shards[shard_ring.get_shard(name)];
+    }
+
     std::shared_ptr<spdlog::logger> logger;
-    asio::io_service& io_service;
-    asio::io_service::strand chromecasts_strand;
-    std::unordered_map<std::string, std::shared_ptr<Chromecast>> chromecasts;
+    asio::io_service& io_service;  // of discovery and sync groups
+    ConsistentHashRing shard_ring;
+    std::vector<std::unique_ptr<Shard>> shards;
+    // Guards state of sync groups below, sync_groups are not changed after constructor.
+    asio::io_service::strand groups_strand;
+    std::unordered_map<std::string, std::vector<std::string>> sync_groups;
+    std::unordered_map<std::string, std::string> active_groups;  // device name -> group name
+    std::unordered_map<std::string, Chromecast::StreamState> group_states;
+    Chromecast::StreamState standby_state;  // state of discovered devices without audio
+    std::shared_ptr<TlsClientContext> tls_context;  // shared by connections to all devices
     AudioSinksManager sinks_manager;
     ChromecastFinder finder;
     WebsocketBroadcaster broadcaster;
@@ -0,0 +1,45 @@
+/* clock_sync.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cassert>
+
+#include "clock_sync.h"
+
+void ClockSync::add_sample(int64_t t0, int64_t t1, int64_t t2, int64_t t3) {
+    Sample sample;
+    sample.offset = ((t1 - t0) + (t2 - t3)) / 2;
+    sample.rtt = std::max<int64_t>(0, (t3 - t0) - (t2 - t1));
+    samples.push_back(sample);
+    if (samples.size() > window) {
+        samples.pop_front();
+    }
+}
+
+const ClockSync::Sample& ClockSync::best_sample() const {
+    assert(!samples.empty());
+    return *std::min_element(samples.begin(), samples.end(),
+                             [](const Sample& a, const Sample& b) { return a.rtt < b.rtt; });
+}
+
+int64_t ClockSync::get_offset() const {
+    return best_sample().offset;
+}
+
+int64_t ClockSync::get_rtt() const {
+    return best_sample().rtt;
+}
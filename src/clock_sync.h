@@ -0,0 +1,65 @@
+/* clock_sync.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+/*
+ * ClockSync estimates offset between sender monotonic clock and receiver clock from NTP style
+ * round trips. Every sample consists of:
+ *  - t0: sender time when request was sent,
+ *  - t1: receiver time when request was received,
+ *  - t2: receiver time when response was sent,
+ *  - t3: sender time when response was received.
+ *
+ * Offset is taken from the sample with the smallest round trip time in the window, it's the one
+ * least affected by queuing in the network.
+ */
+class ClockSync {
+  public:
+    explicit ClockSync(std::size_t window_ = 8) : window(window_) {}
+
+    void add_sample(int64_t t0, int64_t t1, int64_t t2, int64_t t3);
+
+    bool has_offset() const {
+        return !samples.empty();
+    }
+
+    // Receiver clock minus sender clock in microseconds.
+    int64_t get_offset() const;
+
+    // Round trip time of the sample used for offset in microseconds.
+    int64_t get_rtt() const;
+
+    void reset() {
+        samples.clear();
+    }
+
+  private:
+    struct Sample {
+        int64_t offset;
+        int64_t rtt;
+    };
+
+    const Sample& best_sample() const;
+
+    const std::size_t window;
+    std::deque<Sample> samples;
+};
@@ -0,0 +1,56 @@
+/* consistent_hash_ring.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cassert>
+
+#include "consistent_hash_ring.h"
+
+ConsistentHashRing::ConsistentHashRing(std::size_t num_shards_, std::size_t points_per_shard)
+        : num_shards(num_shards_) {
+    assert(num_shards > 0 && points_per_shard > 0);
+    points.reserve(num_shards * points_per_shard);
+    for (std::size_t shard = 0; shard < num_shards; ++shard) {
+        for (std::size_t i = 0; i < points_per_shard; ++i) {
+            points.emplace_back(hash(std::to_string(shard) + "#" + std::to_string(i)), shard);
+        }
+    }
+    std::sort(points.begin(), points.end());
+}
+
+std::size_t ConsistentHashRing::get_shard(const std::string& key) const {
+    // Key belongs to the first point at or after its hash, wrapping around the ring.
+    auto it = std::lower_bound(points.begin(), points.end(),
+                               std::make_pair(hash(key), static_cast<std::size_t>(0)));
+    if (it == points.end()) {
+        it = points.begin();
+    }
+    return it->second;
+}
+
+uint64_t ConsistentHashRing::hash(const std::string& key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    // FNV alone clusters similar short keys like "1#2" and "1#3".
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
@@ -0,0 +1,47 @@
+/* consistent_hash_ring.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * ConsistentHashRing assigns string keys to a fixed number of shards. Every shard owns many points
+ * on the ring so keys are spread evenly, and adding a shard moves only keys that fall to the new
+ * shard's points, the rest stays where it was.
+ */
+class ConsistentHashRing {
+  public:
+    explicit ConsistentHashRing(std::size_t num_shards_, std::size_t points_per_shard = 160);
+
+    std::size_t get_shard(const std::string& key) const;
+
+    std::size_t get_num_shards() const {
+        return num_shards;
+    }
+
+    // FNV-1a with a final mix, stable between runs unlike std::hash.
+    static uint64_t hash(const std::string& key);
+
+  private:
+    const std::size_t num_shards;
+    std::vector<std::pair<uint64_t, std::size_t>> points;  // sorted by hash
+};
@@ -0,0 +1,137 @@
+/* converter_benchmark.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how long AudioConverter takes per sample for common conversions and how many sinks
+ * converted that way fit in a single core.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "audio_converter.h"
+#include "audio_dsp.h"
+#include "audio_frame_pool.h"
+
+DEFINE_int32(seconds, 60, "seconds of audio converted in every case");
+DEFINE_int32(fragment_ms, 20, "duration of single captured fragment in milliseconds");
+DEFINE_int32(sinks, 16, "number of simultaneous sinks that have to fit in one core");
+
+struct BenchmarkCase {
+    AudioFormat in, out;
+};
+
+static AudioFormat make_format(SampleFormat sample_format, uint32_t rate) {
+    AudioFormat format;
+    format.sample_format = sample_format;
+    format.rate = rate;
+    return format;
+}
+
+// Returns nanoseconds spent per input sample frame (sample of every channel).
+static double run_case(const BenchmarkCase& c) {
+    const std::size_t fragment_frames = c.in.rate * FLAGS_fragment_ms / 1000;
+    const std::size_t fragments = FLAGS_seconds * 1000 / FLAGS_fragment_ms;
+
+    // Big enough for a whole fragment in any format.
+    auto pool = AudioFramePool::create(16, fragment_frames * 4 * c.in.channels * 2);
+    AudioConverter converter(c.in, c.out, pool);
+
+    // Sine wave in the input format, the same fragment is converted over and over.
+    std::vector<float> sine(fragment_frames * c.in.channels);
+    for (std::size_t i = 0; i < fragment_frames; ++i) {
+        for (unsigned ch = 0; ch < c.in.channels; ++ch) {
+            sine[i * c.in.channels + ch] =
+                    0.5f * static_cast<float>(std::sin(2.0 * M_PI * 440.0 * i / c.in.rate));
+        }
+    }
+    std::vector<char> input(fragment_frames * c.in.get_frame_size());
+    switch (c.in.sample_format) {
+        case SampleFormat::S16LE:
+            audio_dsp::float_to_s16(sine.data(), reinterpret_cast<int16_t*>(input.data()),
+                                    sine.size());
+            break;
+        case SampleFormat::S24LE:
+            audio_dsp::float_to_s24(sine.data(), reinterpret_cast<uint8_t*>(input.data()),
+                                    sine.size());
+            break;
+        case SampleFormat::F32LE: std::memcpy(input.data(), sine.data(), input.size()); break;
+    }
+
+    std::size_t output_bytes = 0;
+    auto output = [&](AudioFrameRef frame) { output_bytes += frame->size(); };
+
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < fragments; ++i) {
+        auto frame = pool->acquire();
+        std::memcpy(frame->data(), input.data(), input.size());
+        frame->set_size(input.size());
+        frame->set_format(c.in);
+        converter.convert(std::move(frame), output);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    if (output_bytes == 0) {
+        std::fprintf(stderr, "Converter didn't produce any output\n");
+    }
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns / (fragments * fragment_frames);
+}
+
+int main(int argc, char* argv[]) {
+    gflags::SetUsageMessage("Benchmark of audio format conversion and resampling");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    if (FLAGS_seconds <= 0 || FLAGS_fragment_ms <= 0 || FLAGS_sinks <= 0) {
+        std::fprintf(stderr, "All flags have to be positive\n");
+        return 1;
+    }
+
+    const BenchmarkCase cases[] = {
+            {make_format(SampleFormat::S16LE, 48000), make_format(SampleFormat::F32LE, 48000)},
+            {make_format(SampleFormat::F32LE, 48000), make_format(SampleFormat::S16LE, 48000)},
+            {make_format(SampleFormat::S24LE, 48000), make_format(SampleFormat::F32LE, 48000)},
+            {make_format(SampleFormat::S16LE, 44100), make_format(SampleFormat::F32LE, 48000)},
+            {make_format(SampleFormat::S16LE, 48000), make_format(SampleFormat::S16LE, 44100)},
+            {make_format(SampleFormat::F32LE, 48000), make_format(SampleFormat::F32LE, 96000)},
+    };
+
+    std::printf("Using %s kernels, %d fragments of %d ms\n",
+                audio_dsp::get_implementation_name(), FLAGS_seconds * 1000 / FLAGS_fragment_ms,
+                FLAGS_fragment_ms);
+    std::printf("%-22s %12s %14s %10s\n", "conversion", "ns/sample", "sinks/core", "status");
+    bool all_ok = true;
+    for (const auto& c : cases) {
+        double ns_per_sample = run_case(c);
+        double sinks_per_core = 1e9 / (ns_per_sample * c.in.rate);
+        bool ok = sinks_per_core >= FLAGS_sinks;
+        all_ok = all_ok && ok;
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "%s/%u -> %s/%u",
+                      AudioFormat::get_name(c.in.sample_format), c.in.rate,
+                      AudioFormat::get_name(c.out.sample_format), c.out.rate);
+        std::printf("%-22s %12.2f %14.1f %10s\n", name, ns_per_sample, sinks_per_core,
+                    ok ? "ok" : "too slow");
+    }
+    return all_ok ? 0 : 2;
+}
@@ -0,0 +1,125 @@
+/* io_service_pool.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include "io_service_pool.h"
+
+IoServicePool::IoServicePool(std::size_t num_threads_, bool per_core_, const char* logger_name)
+        : num_threads(std::max<std::size_t>(1, num_threads_)), per_core(per_core_) {
+    logger = spdlog::get(logger_name);
+    if (per_core) {
+        for (std::size_t i = 0; i < num_threads; ++i) {
+            // Concurrency hint tells asio that only one thread runs the io_service.
+            io_services.emplace_back(std::make_unique<asio::io_service>(1));
+            works.emplace_back(std::make_unique<asio::io_service::work>(*io_services.back()));
+        }
+    } else {
+        io_services.emplace_back(std::make_unique<asio::io_service>(num_threads));
+    }
+    // Capture at the end, so devices spread from the start don't share its core for long.
+    place(Role::CONTROL, 0);
+    place(Role::CAPTURE, num_threads - 1);
+    place(Role::WEBSOCKET, num_threads > 2 ? num_threads - 2 : 0);
+}
+
+void IoServicePool::place(Role role, std::size_t thread) {
+    role_threads[static_cast<std::size_t>(role)] = thread % num_threads;
+}
+
+asio::io_service& IoServicePool::get_io_service(Role role) {
+    if (!per_core) {
+        return *io_services[0];
+    }
+    return *io_services[role_threads[static_cast<std::size_t>(role)]];
+}
+
+asio::io_service& IoServicePool::get_io_service_for(std::size_t index) {
+    if (!per_core || num_threads == 1) {
+        return *io_services[0];
+    }
+    // Capture thread is left only for capture.
+    const std::size_t capture = role_threads[static_cast<std::size_t>(Role::CAPTURE)];
+    std::size_t thread = index % (num_threads - 1);
+    return *io_services[thread >= capture ? thread + 1 : thread];
+}
+
+void IoServicePool::run() {
+    // CPUs process is allowed to run on, they don't have to be numbered from 0.
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        }
+    }
+    if (pin && cpus.empty()) {
+        logger->warn("(IoServicePool) Failed to get allowed CPUs, threads are not pinned");
+    }
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < num_threads; ++i) {
+        int cpu = pin && !cpus.empty() ? cpus[i % cpus.size()] : -1;
+        asio::io_service& io_service = *io_services[per_core ? i : 0];
+        threads.emplace_back([this, i, cpu, &io_service] {
+            configure_thread(i, cpu);
+            io_service.run();
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void IoServicePool::stop() {
+    std::lock_guard<std::mutex> guard(works_mutex);
+    works.clear();
+}
+
+void IoServicePool::configure_thread(std::size_t thread, int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error != 0) {
+            logger->warn("(IoServicePool) Failed to pin thread {} to CPU {}: {}", thread, cpu,
+                         std::strerror(error));
+        }
+    }
+    if (per_core && capture_priority > 0 &&
+        thread == role_threads[static_cast<std::size_t>(Role::CAPTURE)]) {
+        sched_param param;
+        std::memset(&param, 0, sizeof(param));
+        param.sched_priority = capture_priority;
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error != 0) {
+            logger->warn(
+                    "(IoServicePool) Failed to set SCHED_FIFO priority {} of capture thread, it "
+                    "needs RLIMIT_RTPRIO or CAP_SYS_NICE: {}",
+                    capture_priority, std::strerror(error));
+        } else {
+            logger->info("(IoServicePool) Capture thread runs with SCHED_FIFO priority {}",
+                         capture_priority);
+        }
+    }
+}
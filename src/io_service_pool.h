@@ -0,0 +1,82 @@
+/* io_service_pool.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <asio/io_service.hpp>
+
+#include <spdlog/spdlog.h>
+
+/*
+ * IoServicePool owns io_services of the process and threads running them, in one of two models:
+ *  - shared: single io_service run by all threads, handlers migrate freely between cores,
+ *  - per core: every thread runs its own io_service, so everything placed on it stays on one
+ *    core. PulseAudio capture, websocket I/O and control get threads of their own choosing and
+ *    devices are spread over the remaining threads.
+ * Threads can be pinned to CPUs the process is allowed to run on, and the capture thread of per
+ * core pool can run with SCHED_FIFO priority.
+ */
+class IoServicePool {
+  public:
+    enum class Role { CONTROL, CAPTURE, WEBSOCKET };
+
+    IoServicePool(const IoServicePool&) = delete;
+
+    IoServicePool(std::size_t num_threads_, bool per_core_, const char* logger_name = "default");
+
+    // Moves role to thread with index, only meaningful in per core pool.
+    void place(Role role, std::size_t thread);
+
+    void set_pinning(bool pin_) {
+        pin = pin_;
+    }
+
+    // SCHED_FIFO priority of the capture thread, 0 for normal scheduling.
+    void set_capture_priority(int priority) {
+        capture_priority = priority;
+    }
+
+    asio::io_service& get_io_service(Role role);
+
+    // io_service for index-th of many similar components, like device shards.
+    asio::io_service& get_io_service_for(std::size_t index);
+
+    // Runs all io_services until stop is called and they run out of work.
+    void run();
+    // Safe to call from any thread, more than once.
+    void stop();
+
+  private:
+    void configure_thread(std::size_t thread, int cpu);
+
+    std::shared_ptr<spdlog::logger> logger;
+    const std::size_t num_threads;
+    const bool per_core;
+    bool pin = false;
+    int capture_priority = 0;
+    std::vector<std::unique_ptr<asio::io_service>> io_services;
+    // Keeps io_services of per core pool running before anything is placed on them.
+    std::mutex works_mutex;
+    std::vector<std::unique_ptr<asio::io_service::work>> works;
+    std::array<std::size_t, 3> role_threads;  // indexed by Role
+};
@@ -0,0 +1,76 @@
+/* latency_profile.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "audio_format.h"
+
+/*
+ * Latency profile ties together all the knobs that trade latency for number of wakeups:
+ *  - LOW_LATENCY: small fragments for lip-sync with video,
+ *  - BALANCED: default, 20ms fragments,
+ *  - POWER_SAVE: big fragments and no latency adjustment so the host wakes up rarely.
+ */
+struct LatencyProfile {
+    enum class Type { LOW_LATENCY, BALANCED, POWER_SAVE };
+
+    Type type;
+    uint32_t fragment_ms;    // pa_buffer_attr.fragsize of the record stream
+    uint32_t max_buffer_ms;  // pa_buffer_attr.maxlength, older samples are dropped by server
+    bool adjust_latency;     // whether to set PA_STREAM_ADJUST_LATENCY on the record stream
+    uint32_t frame_ms;       // audio sent in a single websocket message
+
+    static LatencyProfile get(Type type) {
+        switch (type) {
+            case Type::LOW_LATENCY: return LatencyProfile{type, 5, 40, true, 5};
+            case Type::BALANCED: return LatencyProfile{type, 20, 200, true, 20};
+            case Type::POWER_SAVE: return LatencyProfile{type, 100, 2000, false, 100};
+        }
+        return LatencyProfile{Type::BALANCED, 20, 200, true, 20};
+    }
+
+    static std::size_t ms_to_bytes(uint32_t ms, const AudioFormat& format) {
+        return format.rate * ms / 1000 * format.get_frame_size();
+    }
+
+    static const char* get_name(Type type) {
+        switch (type) {
+            case Type::LOW_LATENCY: return "low_latency";
+            case Type::BALANCED: return "balanced";
+            case Type::POWER_SAVE: return "power_save";
+        }
+        return "unknown";
+    }
+
+    // Returns false when name is not a known profile.
+    static bool parse(const std::string& name, Type* type) {
+        if (name == "low_latency") {
+            *type = Type::LOW_LATENCY;
+        } else if (name == "balanced") {
+            *type = Type::BALANCED;
+        } else if (name == "power_save") {
+            *type = Type::POWER_SAVE;
+        } else {
+            return false;
+        }
+        return true;
+    }
+};
@@ -17,13 +17,13 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <csignal>
 #include <cstring>
 #include <functional>
 #include <iostream>
 #include <string>
 #include <thread>
-#include <vector>
 
 #include <asio/io_service.hpp>
 #include <asio/signal_set.hpp>
@@ -33,9 +33,20 @@
 #include <gflags/gflags.h>
 
 #include "chromecasts_manager.h"
+#include "io_service_pool.h"
 
 DEFINE_string(stdout_log_color, "auto", "color stdout log output: auto, always or never");
 DEFINE_string(log_level, "info", "logger log level: trace, debug, info, warn, err, critical");
+DEFINE_string(thread_model, "shared",
+              "shared: one io_service run by a thread per core, per_core: io_service and thread "
+              "per core with components placed on chosen threads");
+DEFINE_bool(pin_threads, false, "pin worker threads to CPU cores");
+DEFINE_int32(control_thread, 0, "per_core thread running discovery and sync groups");
+DEFINE_int32(capture_thread, -1, "per_core thread running PulseAudio capture, -1 for the last");
+DEFINE_int32(websocket_thread, -1,
+             "per_core thread running websocket server, -1 for the one before capture");
+DEFINE_int32(capture_priority, 0,
+             "SCHED_FIFO priority of per_core capture thread, 0 for normal scheduling");
 
 std::shared_ptr<spdlog::logger> get_stdout_logger() {
     bool color;
@@ -83,15 +94,40 @@ int main(int argc, char* argv[]) {
 
     default_logger->set_level(get_log_level());
 
-    asio::io_service io_service;
+    if (FLAGS_thread_model != "shared" && FLAGS_thread_model != "per_core") {
+        std::cerr << "Unexpected thread_model '" << FLAGS_thread_model
+                  << "', using default 'shared'" << std::endl;
+        FLAGS_thread_model = "shared";
+    }
+    const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+    IoServicePool io_service_pool(num_threads, FLAGS_thread_model == "per_core", "default");
+    io_service_pool.set_pinning(FLAGS_pin_threads);
+    io_service_pool.set_capture_priority(FLAGS_capture_priority);
+    io_service_pool.place(IoServicePool::Role::CONTROL, FLAGS_control_thread);
+    if (FLAGS_capture_thread >= 0) {
+        io_service_pool.place(IoServicePool::Role::CAPTURE, FLAGS_capture_thread);
+    }
+    if (FLAGS_websocket_thread >= 0) {
+        io_service_pool.place(IoServicePool::Role::WEBSOCKET, FLAGS_websocket_thread);
+    }
 
-    ChromecastsManager manager(io_service, "default");
+    ChromecastsManager manager(io_service_pool, "default");
 
-    asio::signal_set signals(io_service, SIGINT, SIGTERM);
+    asio::io_service& control_io_service =
+            io_service_pool.get_io_service(IoServicePool::Role::CONTROL);
+    asio::signal_set signals(control_io_service, SIGINT, SIGTERM);
 
+    // Errors and signals can come from different threads of per core pool at once, so stopping
+    // is done only once on the control thread.
+    bool stopping = false;  // only accessed from control thread
     auto stop_everything = [&] {
-        manager.stop();
-        signals.cancel();
+        control_io_service.post([&] {
+            if (stopping) return;
+            stopping = true;
+            manager.stop();
+            signals.cancel();
+            io_service_pool.stop();
+        });
     };
 
     manager.set_error_handler([&](const std::string& message) {
@@ -108,13 +144,7 @@ int main(int argc, char* argv[]) {
 
     manager.start();
 
-    std::vector<std::thread> threads;
-    for (unsigned i = 0; i < std::thread::hardware_concurrency(); ++i) {
-        threads.emplace_back([&io_service]() { io_service.run(); });
-    }
-    for (auto& t : threads) {
-        t.join();
-    }
+    io_service_pool.run();
 
     return 0;
 }
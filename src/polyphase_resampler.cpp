@@ -0,0 +1,136 @@
+/* polyphase_resampler.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "audio_dsp.h"
+#include "polyphase_resampler.h"
+
+static constexpr uint32_t max_phases = 4096;
+// Fraction of the lower Nyquist frequency that is passed through.
+static constexpr double passband = 0.91;
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Zeroth order modified Bessel function of the first kind, for Kaiser window.
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+PolyphaseResampler::PolyphaseResampler(uint32_t in_rate, uint32_t out_rate, unsigned channels_)
+        : channels(channels_), history(channels_), position(0), phase(0) {
+    if (in_rate == 0 || out_rate == 0 || channels == 0) {
+        throw ResamplerException("Invalid resampler configuration");
+    }
+    uint32_t divisor = gcd(in_rate, out_rate);
+    interpolation = out_rate / divisor;
+    decimation = in_rate / divisor;
+    if (interpolation > max_phases) {
+        throw ResamplerException("Can't resample from " + std::to_string(in_rate) + " to " +
+                                 std::to_string(out_rate) + ", ratio is too complex");
+    }
+
+    // Prototype low pass filter works at in_rate * interpolation.
+    const std::size_t length = interpolation * taps_per_phase;
+    const double cutoff = passband * 0.5 / std::max(interpolation, decimation);  // per sample
+    const double beta = 8.0;
+    const double center = (length - 1) / 2.0;
+    std::vector<double> prototype(length);
+    for (std::size_t k = 0; k < length; ++k) {
+        double t = k - center;
+        double sinc = t == 0.0 ? 2.0 * cutoff : std::sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+        double r = t / center;
+        double window =
+                bessel_i0(beta * std::sqrt(std::max(0.0, 1.0 - r * r))) / bessel_i0(beta);
+        // Every phase sees only every interpolation-th tap, so gain is restored here.
+        prototype[k] = sinc * window * interpolation;
+    }
+
+    coefficients.resize(length);
+    for (uint32_t p = 0; p < interpolation; ++p) {
+        for (std::size_t j = 0; j < taps_per_phase; ++j) {
+            coefficients[p * taps_per_phase + (taps_per_phase - 1 - j)] =
+                    static_cast<float>(prototype[p + j * interpolation]);
+        }
+    }
+    reset();
+}
+
+void PolyphaseResampler::reset() {
+    for (auto& h : history) {
+        h.assign(taps_per_phase - 1, 0.0f);
+    }
+    position = taps_per_phase - 1;
+    phase = 0;
+}
+
+std::size_t PolyphaseResampler::process(const float* in, std::size_t frames,
+                                        std::vector<float>& out) {
+    for (unsigned c = 0; c < channels; ++c) {
+        auto& h = history[c];
+        std::size_t old_size = h.size();
+        h.resize(old_size + frames);
+        for (std::size_t i = 0; i < frames; ++i) {
+            h[old_size + i] = in[i * channels + c];
+        }
+    }
+
+    const std::size_t available = history[0].size();
+    std::size_t max_produced = 0;
+    if (position < available) {
+        max_produced = (available - position) * interpolation / decimation + 1;
+    }
+    const std::size_t out_start = out.size();
+    out.resize(out_start + max_produced * channels);
+
+    std::size_t produced = 0;
+    while (position < available) {
+        const float* taps = &coefficients[phase * taps_per_phase];
+        float* dst = &out[out_start + produced * channels];
+        for (unsigned c = 0; c < channels; ++c) {
+            const float* window = &history[c][position + 1 - taps_per_phase];
+            dst[c] = audio_dsp::dot_product(taps, window, taps_per_phase);
+        }
+        ++produced;
+        phase += decimation;
+        position += phase / interpolation;
+        phase %= interpolation;
+    }
+
+    out.resize(out_start + produced * channels);
+
+    // Keep only samples that will still be needed by the next call.
+    std::size_t consumed = std::min(position - (taps_per_phase - 1), available);
+    for (auto& h : history) {
+        h.erase(h.begin(), h.begin() + static_cast<std::ptrdiff_t>(consumed));
+    }
+    position -= consumed;
+    return produced;
+}
@@ -0,0 +1,60 @@
+/* polyphase_resampler.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class ResamplerException : public std::runtime_error {
+  public:
+    ResamplerException(std::string message) : std::runtime_error(message) {}
+};
+
+/*
+ * Resamples interleaved float samples by rational factor out_rate / in_rate with windowed sinc
+ * filter split into polyphase filter bank, so only taps that contribute to output are computed.
+ *
+ * Buffers grow to the size of the largest processed fragment and are reused afterwards, so in
+ * steady state resampling doesn't allocate.
+ */
+class PolyphaseResampler {
+  public:
+    static constexpr std::size_t taps_per_phase = 32;
+
+    PolyphaseResampler(const PolyphaseResampler&) = delete;
+
+    // Throws ResamplerException when rates are invalid or their ratio needs too many phases.
+    PolyphaseResampler(uint32_t in_rate, uint32_t out_rate, unsigned channels);
+
+    // Appends resampled frames to out, returns number of appended frames.
+    std::size_t process(const float* in, std::size_t frames, std::vector<float>& out);
+
+    void reset();
+
+  private:
+    uint32_t interpolation, decimation;  // out_rate / in_rate reduced to lowest terms
+    unsigned channels;
+    // Coefficients of every phase are reversed, so they can be multiplied with history directly.
+    std::vector<float> coefficients;
+    std::vector<std::vector<float>> history;  // per channel, deinterleaved
+    std::size_t position;
+    uint32_t phase;
+};
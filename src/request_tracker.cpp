@@ -0,0 +1,134 @@
+/* request_tracker.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "request_tracker.h"
+
+constexpr std::array<int64_t, 12> RequestStats::bucket_bounds_ms;
+constexpr int64_t RequestTracker::tick;
+constexpr std::size_t RequestTracker::num_slots;
+
+void RequestStats::add_latency(const std::string& type, int64_t latency) {
+    auto bucket = std::lower_bound(bucket_bounds_ms.begin(), bucket_bounds_ms.end(),
+                                   (latency + 999) / 1000) -
+                  bucket_bounds_ms.begin();
+    std::lock_guard<std::mutex> guard(mu);
+    auto& histogram = histograms[type];
+    ++histogram.count;
+    histogram.total_latency += latency;
+    ++histogram.buckets[bucket];
+}
+
+void RequestStats::add_retry(const std::string& type) {
+    std::lock_guard<std::mutex> guard(mu);
+    ++histograms[type].retries;
+}
+
+void RequestStats::add_timeout(const std::string& type) {
+    std::lock_guard<std::mutex> guard(mu);
+    ++histograms[type].timeouts;
+}
+
+std::map<std::string, RequestStats::Histogram> RequestStats::get_histograms() const {
+    std::lock_guard<std::mutex> guard(mu);
+    return histograms;
+}
+
+void RequestTracker::add(int request_id, std::string type, int64_t timeout, int retries,
+                         RetryFunc retry, TimeoutFunc on_timeout, int64_t now) {
+    if (current_tick < 0) {
+        current_tick = now / tick;
+    }
+    auto& request = requests[request_id];
+    request.type = std::move(type);
+    request.sent_time = now;
+    request.timeout = timeout;
+    request.retries_left = retries;
+    request.retry = std::move(retry);
+    request.on_timeout = std::move(on_timeout);
+    schedule(request_id, request, now);
+}
+
+void RequestTracker::schedule(int request_id, Request& request, int64_t now) {
+    // Rounded up, so request never expires before its timeout.
+    request.deadline_tick = std::max(current_tick + 1, (now + request.timeout + tick - 1) / tick);
+    wheel[request.deadline_tick % num_slots].push_back(request_id);
+}
+
+bool RequestTracker::complete(int request_id, int64_t now) {
+    auto it = requests.find(request_id);
+    if (it == requests.end()) {
+        return false;
+    }
+    stats->add_latency(it->second.type, now - it->second.sent_time);
+    requests.erase(it);
+    return true;
+}
+
+bool RequestTracker::cancel(int request_id) {
+    return requests.erase(request_id) > 0;
+}
+
+void RequestTracker::advance(int64_t now) {
+    if (current_tick < 0) {
+        return;
+    }
+    const int64_t target_tick = now / tick;
+    // Every slot is visited at most once, the latest tick it stands for covers earlier ones.
+    int64_t t = std::max(current_tick + 1, target_tick - static_cast<int64_t>(num_slots) + 1);
+    std::vector<int> expired;
+    for (; t <= target_tick; ++t) {
+        auto& slot = wheel[t % num_slots];
+        auto keep = slot.begin();
+        for (int request_id : slot) {
+            auto it = requests.find(request_id);
+            if (it == requests.end() ||
+                it->second.deadline_tick % num_slots != static_cast<int64_t>(t % num_slots)) {
+                continue;  // completed or rescheduled
+            }
+            if (it->second.deadline_tick <= t) {
+                expired.push_back(request_id);
+            } else {
+                *keep++ = request_id;
+            }
+        }
+        slot.erase(keep, slot.end());
+    }
+    current_tick = std::max(current_tick, target_tick);
+
+    // Callbacks may add new requests, so they are called only after the wheel is consistent.
+    for (int request_id : expired) {
+        auto it = requests.find(request_id);
+        // Request could be in a slot twice after rescheduling, and be already retried here.
+        if (it == requests.end() || it->second.deadline_tick > target_tick) {
+            continue;
+        }
+        auto& request = it->second;
+        if (request.retries_left > 0) {
+            --request.retries_left;
+            stats->add_retry(request.type);
+            schedule(request_id, request, now);
+            request.retry();
+        } else {
+            stats->add_timeout(request.type);
+            auto on_timeout = std::move(request.on_timeout);
+            requests.erase(it);
+            on_timeout();
+        }
+    }
+}
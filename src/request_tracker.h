@@ -0,0 +1,116 @@
+/* request_tracker.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * RequestStats collects latencies of cast channel requests per request type. It outlives channels
+ * so it covers all sessions with a device, and it's thread safe so it can be read for stats.
+ */
+class RequestStats {
+  public:
+    // Upper bounds of latency histogram buckets in milliseconds, the last bucket is unbounded.
+    static constexpr std::array<int64_t, 12> bucket_bounds_ms = {
+            {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000}};
+
+    struct Histogram {
+        uint64_t count = 0;  // completed requests
+        uint64_t retries = 0;
+        uint64_t timeouts = 0;  // requests that timed out after all retries
+        int64_t total_latency = 0;  // sum of latencies of completed requests in microseconds
+        std::array<uint64_t, bucket_bounds_ms.size() + 1> buckets = {};
+    };
+
+    void add_latency(const std::string& type, int64_t latency);
+    void add_retry(const std::string& type);
+    void add_timeout(const std::string& type);
+
+    std::map<std::string, Histogram> get_histograms() const;
+
+  private:
+    mutable std::mutex mu;
+    std::map<std::string, Histogram> histograms;
+};
+
+/*
+ * RequestTracker keeps deadlines of requests waiting for response in a hashed timer wheel, so any
+ * number of pending requests is expired with a single periodic tick. Deadlines are rounded up to
+ * the tick. Expired request is retried while it has retries left, and then its timeout function
+ * is called.
+ *
+ * RequestTracker is not thread safe, all times are monotonic microseconds.
+ */
+class RequestTracker {
+  public:
+    typedef std::function<void()> RetryFunc;
+    typedef std::function<void()> TimeoutFunc;
+
+    static constexpr int64_t tick = 100000;
+
+    RequestTracker(const RequestTracker&) = delete;
+
+    explicit RequestTracker(std::shared_ptr<RequestStats> stats_) : stats(stats_) {}
+
+    void add(int request_id, std::string type, int64_t timeout, int retries, RetryFunc retry,
+             TimeoutFunc on_timeout, int64_t now);
+
+    // Returns false when request is not pending, e.g. it already timed out.
+    bool complete(int request_id, int64_t now);
+
+    // Forgets request that won't be answered without counting it as completed or timed out.
+    bool cancel(int request_id);
+
+    // Handles requests with deadlines up to now.
+    void advance(int64_t now);
+
+    bool empty() const {
+        return requests.empty();
+    }
+
+  private:
+    static constexpr std::size_t num_slots = 64;
+
+    struct Request {
+        std::string type;
+        int64_t sent_time;
+        int64_t timeout;
+        int64_t deadline_tick;
+        int retries_left;
+        RetryFunc retry;
+        TimeoutFunc on_timeout;
+    };
+
+    void schedule(int request_id, Request& request, int64_t now);
+
+    std::shared_ptr<RequestStats> stats;
+    std::unordered_map<int, Request> requests;
+    // Ids of requests by deadline tick modulo number of slots. Completed and rescheduled requests
+    // are removed lazily when their slot is processed.
+    std::array<std::vector<int>, num_slots> wheel;
+    int64_t current_tick = -1;  // last processed tick
+};
@@ -0,0 +1,133 @@
+/* shard_benchmark.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how throughput of per-device events grows with threads when devices are split between
+ * strands of shards by ConsistentHashRing, the way ChromecastsManager does it. Every event does a
+ * fixed amount of CPU work on the strand of its device's shard.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <asio/io_service.hpp>
+#include <asio/strand.hpp>
+
+#include <gflags/gflags.h>
+
+#include "consistent_hash_ring.h"
+
+DEFINE_int32(devices, 150, "number of simulated devices");
+DEFINE_int32(events, 2000, "number of events handled for every device");
+DEFINE_int32(work, 2000, "hash rounds of CPU work done by every event");
+DEFINE_int32(max_threads, 0, "maximum number of threads tested, 0 for number of CPU cores");
+
+struct Device {
+    std::string name;
+    uint64_t state = 0;  // only touched on the strand of device's shard
+};
+
+// Returns events handled per second.
+static double run_case(unsigned threads, std::size_t num_shards) {
+    asio::io_service io_service;
+    ConsistentHashRing ring(num_shards);
+    std::vector<std::unique_ptr<asio::io_service::strand>> strands;
+    for (std::size_t i = 0; i < num_shards; ++i) {
+        strands.emplace_back(std::make_unique<asio::io_service::strand>(io_service));
+    }
+    std::vector<Device> devices(FLAGS_devices);
+    std::vector<asio::io_service::strand*> device_strands;
+    for (int i = 0; i < FLAGS_devices; ++i) {
+        devices[i].name = "Chromecast-" + std::to_string(i);
+        device_strands.push_back(strands[ring.get_shard(devices[i].name)].get());
+    }
+
+    // Events are posted in rounds over all devices like updates coming from the network.
+    for (int event = 0; event < FLAGS_events; ++event) {
+        for (int i = 0; i < FLAGS_devices; ++i) {
+            Device* device = &devices[i];
+            device_strands[i]->post([device] {
+                uint64_t h = device->state;
+                for (int round = 0; round < FLAGS_work; ++round) {
+                    h = ConsistentHashRing::hash(device->name) ^ (h * 31 + round);
+                }
+                device->state = h;
+            });
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back([&io_service] { io_service.run(); });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    uint64_t checksum = 0;
+    for (const auto& device : devices) {
+        checksum ^= device.state;
+    }
+    if (checksum == 0) {
+        std::fprintf(stderr, "Work was optimized out\n");
+    }
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return static_cast<double>(FLAGS_devices) * FLAGS_events / seconds;
+}
+
+int main(int argc, char* argv[]) {
+    gflags::SetUsageMessage("Benchmark of sharding devices between strands");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    if (FLAGS_devices <= 0 || FLAGS_events <= 0 || FLAGS_work <= 0 || FLAGS_max_threads < 0) {
+        std::fprintf(stderr, "Flags have to be positive\n");
+        return 1;
+    }
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (FLAGS_max_threads > 0) {
+        max_threads = static_cast<unsigned>(FLAGS_max_threads);
+    }
+
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    std::printf("%d devices, %d events per device\n", FLAGS_devices, FLAGS_events);
+    std::printf("%8s %8s %14s %10s\n", "threads", "shards", "events/s", "speedup");
+    const double base = run_case(1, 1);
+    std::printf("%8u %8u %14.0f %9.2fx\n", 1u, 1u, base, 1.0);
+    for (unsigned threads : thread_counts) {
+        if (threads == 1) continue;
+        // Single shard is how all devices were handled on one strand before sharding.
+        for (unsigned shards : {1u, threads}) {
+            double throughput = run_case(threads, shards);
+            std::printf("%8u %8u %14.0f %9.2fx\n", threads, shards, throughput,
+                        throughput / base);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* spsc_ring.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/*
+ * Bounded lock-free ring buffer for exactly one producer thread and one consumer thread. It
+ * never blocks: push fails when the ring is full and pop fails when it's empty.
+ */
+template <class T>
+class SpscRing {
+  public:
+    SpscRing(const SpscRing&) = delete;
+
+    explicit SpscRing(std::size_t min_capacity) : slots(round_up_pow2(min_capacity)) {
+        mask = slots.size() - 1;
+    }
+
+    bool push(T&& value) {
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size()) {
+            return false;
+        }
+        slots[t & mask] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value) {
+        std::size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(slots[h & mask]);
+        slots[h & mask] = T();
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only approximate when called concurrently with push or pop.
+    std::size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    std::size_t capacity() const {
+        return slots.size();
+    }
+
+  private:
+    static std::size_t round_up_pow2(std::size_t n) {
+        std::size_t res = 1;
+        while (res < n) res <<= 1;
+        return res;
+    }
+
+    std::vector<T> slots;
+    std::size_t mask;
+    alignas(64) std::atomic<std::size_t> head{0};
+    alignas(64) std::atomic<std::size_t> tail{0};
+};
@@ -0,0 +1,117 @@
+/* tls_client_context.cpp -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sstream>
+
+#include "tls_client_context.h"
+
+// Indexes of ex data with TlsClientContext in SSL_CTX and cache key in SSL, asio itself uses
+// app data of SSL.
+static int get_context_index() {
+    static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+static int get_key_index() {
+    static const int index = SSL_get_ex_new_index(
+            0, nullptr, nullptr, nullptr, [](void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) {
+                delete static_cast<std::string*>(ptr);
+            });
+    return index;
+}
+
+TlsClientContext::TlsClientContext() : context(asio::ssl::context::sslv23_client) {
+    SSL_CTX* ctx = context.native_handle();
+    SSL_CTX_set_ex_data(ctx, get_context_index(), this);
+    // OpenSSL doesn't look up client sessions by itself, they are offered in prepare_handshake.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    // With TLS 1.3 session tickets come after the handshake, callback gets them in both cases.
+    SSL_CTX_sess_set_new_cb(ctx, &TlsClientContext::new_session_callback);
+}
+
+TlsClientContext::~TlsClientContext() {
+    for (auto& session : sessions) {
+        SSL_SESSION_free(session.second);
+    }
+}
+
+std::string TlsClientContext::get_key(const asio::ip::tcp::endpoint& endpoint) {
+    std::stringstream ss;
+    ss << endpoint;
+    return ss.str();
+}
+
+bool TlsClientContext::prepare_handshake(SSL* ssl, const asio::ip::tcp::endpoint& endpoint) {
+    std::string key = get_key(endpoint);
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = sessions.find(key);
+    bool offered = it != sessions.end() && SSL_set_session(ssl, it->second) == 1;
+    SSL_set_ex_data(ssl, get_key_index(), new std::string(std::move(key)));
+    return offered;
+}
+
+bool TlsClientContext::handshake_done(SSL* ssl, int64_t duration) {
+    bool resumed = SSL_session_reused(ssl) == 1;
+    std::lock_guard<std::mutex> guard(mutex);
+    if (resumed) {
+        ++stats.resumed_handshakes;
+        stats.resumed_handshake_time += duration;
+    } else {
+        ++stats.full_handshakes;
+        stats.full_handshake_time += duration;
+    }
+    return resumed;
+}
+
+int TlsClientContext::new_session_callback(SSL* ssl, SSL_SESSION* session) {
+    auto self = static_cast<TlsClientContext*>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), get_context_index()));
+    auto key = static_cast<std::string*>(SSL_get_ex_data(ssl, get_key_index()));
+    if (!self || !key) {
+        return 0;
+    }
+    self->store_session(*key, session);
+    return 1;  // we took the reference
+}
+
+void TlsClientContext::store_session(const std::string& key, SSL_SESSION* session) {
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = sessions.find(key);
+    if (it != sessions.end()) {
+        SSL_SESSION_free(it->second);
+        it->second = session;
+    } else {
+        sessions.emplace(key, session);
+    }
+}
+
+void TlsClientContext::remove_session(const asio::ip::tcp::endpoint& endpoint) {
+    std::string key = get_key(endpoint);
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = sessions.find(key);
+    if (it != sessions.end()) {
+        SSL_SESSION_free(it->second);
+        sessions.erase(it);
+    }
+}
+
+TlsClientContext::Stats TlsClientContext::get_stats() const {
+    std::lock_guard<std::mutex> guard(mutex);
+    Stats result = stats;
+    result.cached_sessions = sessions.size();
+    return result;
+}
@@ -0,0 +1,78 @@
+/* tls_client_context.h -- This file is part of pulseaudio-chromecast-sink
+ * Copyright (C) 2016  Marek Rusinowski
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <openssl/ssl.h>
+
+#include <asio/ip/tcp.hpp>
+#include <asio/ssl.hpp>
+
+/*
+ * TlsClientContext is the ssl::context shared by all connections to Chromecasts together with
+ * cache of their TLS sessions. Sessions are kept per device endpoint, so reconnecting to the
+ * same device does abbreviated handshake instead of the full one.
+ *
+ * All functions are thread safe.
+ */
+class TlsClientContext {
+  public:
+    struct Stats {
+        uint64_t full_handshakes = 0;
+        uint64_t resumed_handshakes = 0;
+        int64_t full_handshake_time = 0;     // total, in microseconds
+        int64_t resumed_handshake_time = 0;  // total, in microseconds
+        std::size_t cached_sessions = 0;
+    };
+
+    TlsClientContext(const TlsClientContext&) = delete;
+
+    TlsClientContext();
+    ~TlsClientContext();
+
+    asio::ssl::context& get_context() {
+        return context;
+    }
+
+    // Has to be called before handshake of every connection, offers cached session of endpoint.
+    // Returns whether there was a session to offer.
+    bool prepare_handshake(SSL* ssl, const asio::ip::tcp::endpoint& endpoint);
+
+    // Records handshake duration in microseconds, returns whether session was resumed.
+    bool handshake_done(SSL* ssl, int64_t duration);
+
+    // Forgets session of endpoint, e.g. after a failed handshake.
+    void remove_session(const asio::ip::tcp::endpoint& endpoint);
+
+    Stats get_stats() const;
+
+  private:
+    static int new_session_callback(SSL* ssl, SSL_SESSION* session);
+    static std::string get_key(const asio::ip::tcp::endpoint& endpoint);
+    void store_session(const std::string& key, SSL_SESSION* session);
+
+    asio::ssl::context context;
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, SSL_SESSION*> sessions;  // owned references
+    Stats stats;
+};
@@ -17,6 +17,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <random>
 #include <string>
 
@@ -49,3 +50,9 @@ std::string replace_all(const std::string& str, const std::string& what, const s
     result.append(prev_it, str.end());
     return result;
 }
+
+int64_t get_monotonic_time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
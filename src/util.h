@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
@@ -55,6 +56,9 @@ std::string generate_random_string(
 
 std::string replace_all(const std::string& str, const std::string& what, const std::string& to);
 
+// Microseconds of monotonic clock, used for timestamping audio and clock synchronization.
+int64_t get_monotonic_time_us();
+
 /*
  * Simple wrapper that wraps any callback handler with std::weak_ptr to make sure that callback
  * target object exists.
@@ -65,9 +69,9 @@ class weak_ptr_wrapper {
     weak_ptr_wrapper(F&& f_, std::weak_ptr<T> ptr_) : f(std::forward<F>(f_)), weak_ptr(ptr_) {}
 
     template <class... Arg>
-    void operator()(Arg... arg) {
+    void operator()(Arg&&... arg) {
         if (auto ptr = weak_ptr.lock()) {
-            f(arg...);
+            f(std::forward<Arg>(arg)...);
         }
     }
 
@@ -15,12 +15,18 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <deque>
 #include <functional>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include <spdlog/spdlog.h>
 
+#include <gflags/gflags.h>
+
 #include <asio/io_service.hpp>
 #include <asio/ip/tcp.hpp>
 
@@ -33,6 +39,286 @@
 
 using json = nlohmann::json;
 
+DEFINE_int32(ws_send_high_watermark, 32768,
+             "websocket buffered bytes above which connection is considered congested");
+DEFINE_int32(ws_send_low_watermark, 8192,
+             "websocket buffered bytes below which congested connection is considered drained");
+DEFINE_int32(ws_send_queue_size, 65536,
+             "max bytes of audio queued per websocket connection while it is congested");
+DEFINE_string(ws_drop_policy, "drop_oldest",
+              "audio drop policy for congested websocket: drop_oldest, coalesce or skip "
+              "(coalesce applies only to PCM, encoded streams use drop_oldest)");
+DEFINE_int32(silence_keepalive, 1000,
+             "milliseconds between silence markers sent instead of silent audio");
+DEFINE_int32(opus_bitrate, 128000, "default opus bitrate in bits per second");
+DEFINE_int32(opus_frame_duration, 20, "default opus frame duration in ms: 5, 10, 20, 40 or 60");
+
+/*
+ * SendQueue keeps audio frames that couldn't be handed to websocketpp because connection was
+ * congested. It's bounded so the latency added by the queue is bounded as well. Frames are kept
+ * by reference so queueing doesn't copy any audio data.
+ *
+ * websocketpp doesn't notify when its buffer drains so queue is flushed only when new samples
+ * arrive, but that happens every few milliseconds anyway.
+ */
+class WebsocketBroadcaster::SendQueue {
+  public:
+    SendQueue(DropPolicy policy_, std::size_t high_watermark_, std::size_t low_watermark_,
+              std::size_t max_bytes_, int64_t silence_keepalive_us_)
+            : policy(policy_), high_watermark(high_watermark_), low_watermark(low_watermark_),
+              max_bytes(max_bytes_), silence_keepalive_us(silence_keepalive_us_) {}
+
+    std::error_code push(WebsocketServer& server, websocketpp::connection_hdl hdl,
+                         AudioFrameRef frame);
+
+    SendQueueStats get_stats() const;
+
+    void set_frame_header(bool frame_header_) {
+        std::lock_guard<std::mutex> guard(mu);
+        frame_header = frame_header_;
+    }
+
+    // Encoded packets can't be joined or cut, so they are always queued and dropped whole.
+    void set_encoded(bool encoded_) {
+        std::lock_guard<std::mutex> guard(mu);
+        encoded = encoded_;
+    }
+
+  private:
+    struct Entry {
+        AudioFrameRef frame;
+        std::size_t offset;
+        bool silence_marker;
+
+        const char* data() const {
+            return frame->data() + offset;
+        }
+
+        std::size_t size() const {
+            return silence_marker ? 0 : frame->size() - offset;
+        }
+
+        int64_t capture_time() const {
+            return frame->capture_time() + frame->format().get_duration_us(offset);
+        }
+    };
+
+    std::error_code flush(WebsocketServer::connection_ptr& con);
+    std::error_code flush_coalesced(WebsocketServer::connection_ptr& con);
+    std::error_code send_data(WebsocketServer::connection_ptr& con, const char* data,
+                              std::size_t size, int64_t capture_time, uint8_t flags = 0);
+    std::error_code send_entry(WebsocketServer::connection_ptr& con, const Entry& entry);
+    bool is_suppressed(const AudioFrameRef& frame);
+    void enqueue(AudioFrameRef frame, bool silence_marker);
+    void drop_front(std::size_t bytes);
+
+    const DropPolicy policy;
+    const std::size_t high_watermark, low_watermark, max_bytes;
+    const int64_t silence_keepalive_us;
+
+    mutable std::mutex mu;
+    std::deque<Entry> entries;
+    // Reused between flushes so coalescing doesn't allocate in steady state.
+    std::vector<char> coalesce_buffer;
+    std::size_t queued_bytes = 0;
+    bool congested = false;
+    bool frame_header = false;
+    bool encoded = false;
+    uint32_t sequence = 0;
+    bool in_silence = false;
+    int64_t last_marker_time = 0;
+    uint64_t sent_frames = 0, dropped_frames = 0, dropped_bytes = 0, suppressed_frames = 0;
+};
+
+std::error_code WebsocketBroadcaster::SendQueue::push(WebsocketServer& server,
+                                                      websocketpp::connection_hdl hdl,
+                                                      AudioFrameRef frame) {
+    std::error_code error;
+    auto con = server.get_con_from_hdl(hdl, error);
+    if (error) return error;
+
+    std::lock_guard<std::mutex> guard(mu);
+    std::size_t buffered = con->get_buffered_amount();
+    if (buffered >= high_watermark) {
+        congested = true;
+    } else if (buffered <= low_watermark) {
+        congested = false;
+    }
+
+    if (is_suppressed(frame)) {
+        ++suppressed_frames;
+        return error;
+    }
+    bool silence_marker = in_silence;
+
+    if (!congested) {
+        error = flush(con);
+        if (error) return error;
+        if (entries.empty()) {
+            return send_entry(con, Entry{std::move(frame), 0, silence_marker});
+        }
+    }
+    enqueue(std::move(frame), silence_marker);
+    return error;
+}
+
+// Silent frames are replaced by markers, only sent at the start and then once in a while.
+bool WebsocketBroadcaster::SendQueue::is_suppressed(const AudioFrameRef& frame) {
+    if (!frame_header || !frame->silent()) {
+        in_silence = false;
+        return false;
+    }
+    int64_t time = frame->capture_time();
+    if (in_silence && time - last_marker_time < silence_keepalive_us) {
+        return true;
+    }
+    in_silence = true;
+    last_marker_time = time;
+    return false;
+}
+
+std::error_code WebsocketBroadcaster::SendQueue::flush(WebsocketServer::connection_ptr& con) {
+    if (policy == DropPolicy::COALESCE && !encoded) {
+        return flush_coalesced(con);
+    }
+    while (!entries.empty() && con->get_buffered_amount() < high_watermark) {
+        auto& entry = entries.front();
+        auto error = send_entry(con, entry);
+        if (error) return error;
+        queued_bytes -= entry.size();
+        entries.pop_front();
+    }
+    return std::error_code();
+}
+
+std::error_code WebsocketBroadcaster::SendQueue::flush_coalesced(
+        WebsocketServer::connection_ptr& con) {
+    // Audio between silence markers is sent as one message, markers on their own.
+    while (!entries.empty()) {
+        if (entries.front().silence_marker) {
+            auto error = send_entry(con, entries.front());
+            if (error) return error;
+            entries.pop_front();
+            continue;
+        }
+        int64_t capture_time = entries.front().capture_time();
+        coalesce_buffer.clear();
+        while (!entries.empty() && !entries.front().silence_marker) {
+            auto& entry = entries.front();
+            coalesce_buffer.insert(coalesce_buffer.end(), entry.data(),
+                                   entry.data() + entry.size());
+            queued_bytes -= entry.size();
+            entries.pop_front();
+        }
+        auto error = send_data(con, coalesce_buffer.data(), coalesce_buffer.size(), capture_time);
+        if (error) return error;
+    }
+    return std::error_code();
+}
+
+std::error_code WebsocketBroadcaster::SendQueue::send_entry(WebsocketServer::connection_ptr& con,
+                                                            const Entry& entry) {
+    return send_data(con, entry.data(), entry.size(), entry.capture_time(),
+                     entry.silence_marker ? frame_flag_silence : 0);
+}
+
+static void write_frame_header(char* out, uint32_t sequence, int64_t capture_time,
+                               uint8_t flags) {
+    uint64_t time = static_cast<uint64_t>(capture_time);
+    out[0] = 1;  // version
+    out[1] = static_cast<char>(flags);
+    out[2] = static_cast<char>(WebsocketBroadcaster::frame_header_size);
+    out[3] = 0;
+    for (int i = 0; i < 4; ++i) {
+        out[4 + i] = static_cast<char>(sequence >> (8 * i));
+    }
+    for (int i = 0; i < 8; ++i) {
+        out[8 + i] = static_cast<char>(time >> (8 * i));
+    }
+}
+
+std::error_code WebsocketBroadcaster::SendQueue::send_data(WebsocketServer::connection_ptr& con,
+                                                           const char* data, std::size_t size,
+                                                           int64_t capture_time, uint8_t flags) {
+    std::error_code error;
+    if (frame_header) {
+        // Header and samples are put straight into websocketpp message to avoid another copy.
+        char header[frame_header_size];
+        write_frame_header(header, sequence, capture_time, flags);
+        auto message = con->get_message(websocketpp::frame::opcode::binary,
+                                        frame_header_size + size);
+        message->append_payload(header, frame_header_size);
+        message->append_payload(data, size);
+        error = con->send(message);
+    } else {
+        error = con->send(data, size, websocketpp::frame::opcode::binary);
+    }
+    if (!error) {
+        ++sequence;
+        ++sent_frames;
+    }
+    return error;
+}
+
+void WebsocketBroadcaster::SendQueue::enqueue(AudioFrameRef frame, bool silence_marker) {
+    if (silence_marker) {
+        // Markers don't take any space in the queue, so they are never dropped for space.
+        entries.push_back(Entry{std::move(frame), 0, true});
+        return;
+    }
+    std::size_t size = frame->size();
+    if (policy == DropPolicy::SKIP || size > max_bytes) {
+        ++dropped_frames;
+        dropped_bytes += size;
+        return;
+    }
+
+    if (queued_bytes + size > max_bytes) {
+        drop_front(queued_bytes + size - max_bytes);
+    }
+
+    entries.push_back(Entry{std::move(frame), 0, false});
+    queued_bytes += size;
+}
+
+void WebsocketBroadcaster::SendQueue::drop_front(std::size_t bytes) {
+    while (bytes > 0 && !entries.empty()) {
+        auto& front = entries.front();
+        if (front.silence_marker) {
+            // Audio after it is already queued, so the silence is over anyway.
+            entries.pop_front();
+        } else if (front.size() <= bytes || policy != DropPolicy::COALESCE || encoded) {
+            bytes -= std::min(bytes, front.size());
+            queued_bytes -= front.size();
+            dropped_bytes += front.size();
+            ++dropped_frames;
+            entries.pop_front();
+        } else {
+            // Coalesced data is sent as one stream so we can trim just the oldest samples.
+            std::size_t frame_size = front.frame->format().get_frame_size();
+            std::size_t trim = (bytes + frame_size - 1) / frame_size;
+            trim = std::min(trim * frame_size, front.size());
+            front.offset += trim;
+            queued_bytes -= trim;
+            dropped_bytes += trim;
+            bytes = 0;
+        }
+    }
+}
+
+WebsocketBroadcaster::SendQueueStats WebsocketBroadcaster::SendQueue::get_stats() const {
+    std::lock_guard<std::mutex> guard(mu);
+    SendQueueStats stats;
+    stats.queued_bytes = queued_bytes;
+    stats.queued_frames = entries.size();
+    stats.sent_frames = sent_frames;
+    stats.dropped_frames = dropped_frames;
+    stats.dropped_bytes = dropped_bytes;
+    stats.suppressed_frames = suppressed_frames;
+    stats.congested = congested;
+    return stats;
+}
+
 WebsocketBroadcaster::WebsocketBroadcaster(asio::io_service& io_service_, const char* logger_name)
         : io_service(io_service_), connections_strand(io_service) {
     using namespace std::placeholders;
@@ -47,6 +333,7 @@ WebsocketBroadcaster::WebsocketBroadcaster(asio::io_service& io_service_, const
     ws_server.set_message_handler(std::bind(&WebsocketBroadcaster::on_message, this, _1, _2));
     ws_server.set_socket_init_handler(
             std::bind(&WebsocketBroadcaster::on_socket_init, this, _1, _2));
+    ws_server.set_http_handler(std::bind(&WebsocketBroadcaster::on_http, this, _1));
     ws_server.listen(0);
 }
 
@@ -62,11 +349,30 @@ void WebsocketBroadcaster::on_message(websocketpp::connection_hdl hdl,
     std::string type = json_msg["type"];
     if (type == "SUBSCRIBE") {
         std::string chromecast_name = json_msg["name"];
-        logger->debug("(WebsocketBroadcaster) Chromecast {} subscribed", chromecast_name);
-        MessageHandler message_handler;
-        message_handler.hdl = hdl;
-        message_handler.this_ptr = this;
-        subscribe_handler(message_handler, chromecast_name);
+        CodecConfig codec = negotiate_codec(json_msg);
+        AudioFormat format = negotiate_format(json_msg, codec);
+        bool frame_header = json_msg.value("frameHeader", false);
+        logger->debug("(WebsocketBroadcaster) Chromecast {} subscribed with codec {}, "
+                      "format {} {}Hz",
+                      chromecast_name, CodecConfig::get_name(codec.codec),
+                      AudioFormat::get_name(format.sample_format), format.rate);
+        connections_strand.dispatch([this, hdl, chromecast_name, codec, format, frame_header] {
+            auto it = connections.find(hdl);
+            if (it == connections.end()) {
+                logger->warn("(WebsocketBroadcaster) Subscribe from already closed connection");
+                return;
+            }
+            MessageHandler message_handler;
+            message_handler.hdl = hdl;
+            message_handler.this_ptr = this;
+            message_handler.send_queue = it->second;
+            message_handler.codec = codec;
+            message_handler.format = format;
+            message_handler.frame_header = frame_header;
+            it->second->set_frame_header(frame_header);
+            it->second->set_encoded(codec.codec != CodecConfig::Codec::PCM);
+            subscribe_handler(message_handler, chromecast_name);
+        });
     } else {
         logger->warn("(WebsocketBroadcaster) Unexpected message type: {}", type);
     }
@@ -79,7 +385,8 @@ void WebsocketBroadcaster::on_message(websocketpp::connection_hdl hdl,
 void WebsocketBroadcaster::stop() {
     ws_server.stop_listening();
     connections_strand.dispatch([this] {
-        for (auto hdl : connections) {
+        for (auto& connection : connections) {
+            auto hdl = connection.first;
             try {
                 logger->trace("(WebsocketBroadcaster) stopping connection");
                 ws_server.close(hdl, websocketpp::close::status::normal, "");
@@ -107,12 +414,115 @@ void WebsocketBroadcaster::start() {
 
 void WebsocketBroadcaster::on_open(websocketpp::connection_hdl hdl) {
     logger->trace("(WebsocketBroadcaster) New connection");
-    connections_strand.dispatch([this, hdl] { connections.insert(hdl); });
+    auto send_queue = std::make_shared<SendQueue>(
+            get_drop_policy(), static_cast<std::size_t>(FLAGS_ws_send_high_watermark),
+            static_cast<std::size_t>(FLAGS_ws_send_low_watermark),
+            static_cast<std::size_t>(FLAGS_ws_send_queue_size),
+            static_cast<int64_t>(FLAGS_silence_keepalive) * 1000);
+    connections_strand.dispatch([this, hdl, send_queue] { connections.emplace(hdl, send_queue); });
 }
 
 void WebsocketBroadcaster::on_close(websocketpp::connection_hdl hdl) {
     logger->trace("(WebsocketBroadcaster) Closed connection");
-    connections_strand.dispatch([this, hdl] { connections.erase(hdl); });
+    connections_strand.dispatch([this, hdl] {
+        auto it = connections.find(hdl);
+        if (it == connections.end()) return;
+        auto stats = it->second->get_stats();
+        logger->debug(
+                "(WebsocketBroadcaster) Connection closed, sent frames: {}, dropped frames: {}, "
+                "dropped bytes: {}",
+                stats.sent_frames, stats.dropped_frames, stats.dropped_bytes);
+        connections.erase(it);
+    });
+}
+
+/*
+ * Receiver lists codecs it can decode in "codecs" field of SUBSCRIBE, most preferred first. We
+ * pick the first one we support, falling back to PCM which every receiver has to support.
+ */
+CodecConfig WebsocketBroadcaster::negotiate_codec(const json& subscribe_msg) const {
+    CodecConfig config;
+    auto codecs = subscribe_msg.find("codecs");
+    if (codecs == subscribe_msg.end() || !codecs->is_array()) {
+        return config;
+    }
+    for (const auto& name : *codecs) {
+        if (!name.is_string()) continue;
+        if (name == "pcm") {
+            return config;
+        } else if (name == "opus" && CodecConfig::is_supported(CodecConfig::Codec::OPUS)) {
+            config.codec = CodecConfig::Codec::OPUS;
+            config.bitrate = subscribe_msg.value("bitrate", FLAGS_opus_bitrate);
+            config.bitrate = std::max(6000, std::min(510000, config.bitrate));
+            config.frame_duration =
+                    subscribe_msg.value("frameDuration", FLAGS_opus_frame_duration);
+            switch (config.frame_duration) {
+                case 5:
+                case 10:
+                case 20:
+                case 40:
+                case 60: break;
+                default:
+                    logger->warn("(WebsocketBroadcaster) Unsupported opus frame duration {}",
+                                 config.frame_duration);
+                    config.frame_duration = 20;
+            }
+            return config;
+        }
+    }
+    return config;
+}
+
+/*
+ * Receiver can ask for "sampleRate", "channels" and list "sampleFormats" it can play, most
+ * preferred first. Receivers not sending them get 16 bit samples in the rate of the sink. Opus
+ * always works on 16 bit 48kHz stereo.
+ */
+AudioFormat WebsocketBroadcaster::negotiate_format(const json& subscribe_msg,
+                                                   const CodecConfig& codec) const {
+    AudioFormat format;
+    if (codec.codec == CodecConfig::Codec::OPUS) {
+        return format;
+    }
+
+    format.rate = 0;
+    int rate = subscribe_msg.value("sampleRate", 0);
+    if (rate >= 8000 && rate <= 192000) {
+        format.rate = static_cast<uint32_t>(rate);
+    } else if (rate != 0) {
+        logger->warn("(WebsocketBroadcaster) Unsupported sample rate {}", rate);
+    }
+
+    int channels = subscribe_msg.value("channels", 2);
+    if (channels != 2) {
+        logger->warn("(WebsocketBroadcaster) Unsupported number of channels {}, using 2",
+                     channels);
+    }
+
+    auto formats = subscribe_msg.find("sampleFormats");
+    if (formats != subscribe_msg.end() && formats->is_array()) {
+        for (const auto& name : *formats) {
+            if (name.is_string() &&
+                AudioFormat::parse_sample_format(name.get<std::string>(), &format.sample_format)) {
+                break;
+            }
+        }
+    }
+    return format;
+}
+
+WebsocketBroadcaster::DropPolicy WebsocketBroadcaster::get_drop_policy() const {
+    if (FLAGS_ws_drop_policy == "drop_oldest") {
+        return DropPolicy::DROP_OLDEST;
+    } else if (FLAGS_ws_drop_policy == "coalesce") {
+        return DropPolicy::COALESCE;
+    } else if (FLAGS_ws_drop_policy == "skip") {
+        return DropPolicy::SKIP;
+    } else {
+        logger->warn("(WebsocketBroadcaster) Unexpected ws_drop_policy '{}', using 'drop_oldest'",
+                     FLAGS_ws_drop_policy);
+        return DropPolicy::DROP_OLDEST;
+    }
 }
 
 void WebsocketBroadcaster::on_socket_init(websocketpp::connection_hdl /*hdl*/,
@@ -122,15 +532,84 @@ void WebsocketBroadcaster::on_socket_init(websocketpp::connection_hdl /*hdl*/,
     s.set_option(option);
 }
 
-void WebsocketBroadcaster::send_samples(MessageHandler hdl, const AudioSample* samples,
-                                        size_t num) {
-    if (hdl.this_ptr == nullptr) return;
-    std::error_code error;
-    // TODO: add checking of buffered amount and ignore send if there is too much
-    hdl.this_ptr->ws_server.send(hdl.hdl, samples, num * sizeof(AudioSample),
-                                 websocketpp::frame::opcode::binary, error);
-    if (error && error != websocketpp::error::value::bad_connection) {
+void WebsocketBroadcaster::on_http(websocketpp::connection_hdl hdl) {
+    auto con = ws_server.get_con_from_hdl(hdl);
+    if (con->get_resource() != "/stats" || !stats_handler) {
+        con->set_status(websocketpp::http::status_code::not_found);
+        con->set_body("Not found\n");
+        return;
+    }
+    auto error = con->defer_http_response();
+    if (error) {
+        logger->error("(WebsocketBroadcaster) Couldn't defer stats response: {}", error.message());
+        return;
+    }
+
+    connections_strand.dispatch([this, con] {
+        json connections_stats = json::array();
+        for (auto& connection : connections) {
+            auto stats = connection.second->get_stats();
+            connections_stats.push_back({{"queuedBytes", stats.queued_bytes},
+                                         {"queuedFrames", stats.queued_frames},
+                                         {"sentFrames", stats.sent_frames},
+                                         {"droppedFrames", stats.dropped_frames},
+                                         {"droppedBytes", stats.dropped_bytes},
+                                         {"suppressedFrames", stats.suppressed_frames},
+                                         {"congested", stats.congested}});
+        }
+        // Handler may answer from another thread, response is sent from the server's one.
+        stats_handler([this, con, connections_stats](json stats) {
+            stats["connections"] = connections_stats;
+            io_service.post([con, stats] {
+                con->set_status(websocketpp::http::status_code::ok);
+                con->append_header("Content-Type", "application/json");
+                con->set_body(stats.dump(2));
+                con->send_http_response();
+            });
+        });
+    });
+}
+
+bool WebsocketBroadcaster::send_frame(MessageHandler hdl, AudioFrameRef frame) {
+    if (hdl.this_ptr == nullptr) return false;
+    assert(hdl.send_queue != nullptr);
+    auto error = hdl.send_queue->push(hdl.this_ptr->ws_server, hdl.hdl, std::move(frame));
+    if (error == websocketpp::error::value::bad_connection) {
+        return false;
+    } else if (error) {
         hdl.this_ptr->logger->error("(WebsocketBroadcaster) Couldn't send data: {}",
                                     error.message());
     }
+    return true;
+}
+
+bool WebsocketBroadcaster::send_subscribed(const MessageHandler& hdl) {
+    if (hdl.this_ptr == nullptr) return false;
+    json reply = {{"type", "SUBSCRIBED"},
+                  {"codec",
+                   {{"name", CodecConfig::get_name(hdl.codec.codec)},
+                    {"bitrate", hdl.codec.bitrate},
+                    {"frameDuration", hdl.codec.frame_duration}}},
+                  {"sampleFormat", AudioFormat::get_name(hdl.format.sample_format)},
+                  {"sampleRate", hdl.format.rate},
+                  {"channels", hdl.format.channels},
+                  {"frameHeader", hdl.frame_header},
+                  {"layout",
+                   {{"interleaved", true},
+                    {"frameSize", hdl.format.get_frame_size()},
+                    {"payloadOffset", hdl.frame_header ? frame_header_size : 0}}}};
+    std::error_code error;
+    hdl.this_ptr->ws_server.send(hdl.hdl, reply.dump(), websocketpp::frame::opcode::text, error);
+    if (error) {
+        hdl.this_ptr->logger->error("(WebsocketBroadcaster) Couldn't send subscribe reply: {}",
+                                    error.message());
+        return false;
+    }
+    return true;
+}
+
+WebsocketBroadcaster::SendQueueStats WebsocketBroadcaster::get_send_queue_stats(
+        const MessageHandler& hdl) {
+    if (hdl.send_queue == nullptr) return SendQueueStats();
+    return hdl.send_queue->get_stats();
 }
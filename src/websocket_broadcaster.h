@@ -16,27 +16,82 @@
  */
 
 #include <functional>
-#include <set>
+#include <map>
+#include <memory>
 
 #include <spdlog/spdlog.h>
 
 #include <asio/io_service.hpp>
 
 #include <asio/strand.hpp>
+
+#include <json.hpp>
+
 #include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/server.hpp>
 
+#include "audio_encoder.h"
+#include "audio_format.h"
+#include "audio_frame_pool.h"
 #include "audio_sinks_manager.h"
 
 #pragma once
 
 class WebsocketBroadcaster {
   public:
+    /*
+     * What to do with audio frames when the connection is congested, that is when the amount of
+     * data buffered in websocketpp is above the high watermark:
+     *  - DROP_OLDEST: queue new frames and drop the oldest ones when the queue is full,
+     *  - COALESCE: merge queued frames into one message and trim its oldest samples when full,
+     *  - SKIP: don't queue anything, drop new frames until buffer falls below low watermark.
+     */
+    enum class DropPolicy { DROP_OLDEST, COALESCE, SKIP };
+
+    struct SendQueueStats {
+        std::size_t queued_bytes = 0;
+        std::size_t queued_frames = 0;
+        uint64_t sent_frames = 0;
+        uint64_t dropped_frames = 0;
+        uint64_t dropped_bytes = 0;
+        uint64_t suppressed_frames = 0;
+        bool congested = false;
+    };
+
+    class SendQueue;
+
+    /*
+     * When receiver asks for it, every binary message starts with little endian header:
+     *  - uint8 version, currently 1,
+     *  - uint8 flags, frame_flag_silence or 0,
+     *  - uint16 size of the header in bytes,
+     *  - uint32 sequence number of the message in connection,
+     *  - int64 sender monotonic time in microseconds when the first sample was captured.
+     *
+     * Header size is a multiple of 4, so receivers can view samples that follow it as typed
+     * arrays without copying. Messages always contain whole frames of all channels.
+     */
+    static constexpr std::size_t frame_header_size = 16;
+
+    /*
+     * Message without payload marking that audio from its capture time on is digital silence
+     * until the next message without the flag. While silence lasts, markers are only repeated
+     * every --silence_keepalive milliseconds.
+     */
+    static constexpr uint8_t frame_flag_silence = 1;
+
     struct MessageHandler {
         websocketpp::connection_hdl hdl;
         WebsocketBroadcaster* this_ptr = nullptr;
+        std::shared_ptr<SendQueue> send_queue;
+        CodecConfig codec;
+        // Format requested by the receiver, rate 0 when receiver accepts any rate.
+        AudioFormat format;
+        bool frame_header = false;
     };
     typedef std::function<void(MessageHandler, std::string)> SubscribeHandler;
+    typedef std::function<void(nlohmann::json)> StatsCallback;
+    typedef std::function<void(StatsCallback)> StatsHandler;
 
     WebsocketBroadcaster(const WebsocketBroadcaster&) = delete;
 
@@ -49,7 +104,17 @@ class WebsocketBroadcaster {
         subscribe_handler = subscribe_handler_;
     }
 
-    static void send_samples(MessageHandler hdl, const AudioSample* samples, size_t num);
+    // Handler provides stats served as JSON under /stats on the websocket port.
+    void set_stats_handler(StatsHandler stats_handler_) {
+        stats_handler = stats_handler_;
+    }
+
+    // Returns false when the connection is already closed.
+    static bool send_frame(MessageHandler hdl, AudioFrameRef frame);
+    static SendQueueStats get_send_queue_stats(const MessageHandler& hdl);
+
+    // Confirms subscription with codec and format from hdl, must be sent before any audio frame.
+    static bool send_subscribed(const MessageHandler& hdl);
 
     uint16_t get_port() const {
         return port;
@@ -63,12 +128,20 @@ class WebsocketBroadcaster {
     void on_open(websocketpp::connection_hdl hdl);
     void on_close(websocketpp::connection_hdl hdl);
     void on_socket_init(websocketpp::connection_hdl hdl, asio::ip::tcp::socket& s);
+    void on_http(websocketpp::connection_hdl hdl);
+    DropPolicy get_drop_policy() const;
+    CodecConfig negotiate_codec(const nlohmann::json& subscribe_msg) const;
+    AudioFormat negotiate_format(const nlohmann::json& subscribe_msg,
+                                 const CodecConfig& codec) const;
 
     uint16_t port;
     std::shared_ptr<spdlog::logger> logger;
     asio::io_service& io_service;
     asio::io_service::strand connections_strand;
-    std::set<websocketpp::connection_hdl, std::owner_less<websocketpp::connection_hdl>> connections;
+    std::map<websocketpp::connection_hdl, std::shared_ptr<SendQueue>,
+             std::owner_less<websocketpp::connection_hdl>>
+            connections;
     WebsocketServer ws_server;
     SubscribeHandler subscribe_handler = nullptr;
+    StatsHandler stats_handler = nullptr;
 };